@@ -0,0 +1,327 @@
+//
+// Created by PinkLure on 9/22/2022.
+//
+
+#ifndef ALLOCATOR_ALLOC_TRACE_H
+#define ALLOCATOR_ALLOC_TRACE_H
+
+// opt-in latency tracing, build with -DALLOCATOR_TRACE (cmake -DALLOCATOR_TRACE=ON) to turn it on
+// ALLOC_TRACE_SCOPE(site) times the rest of the enclosing scope into the calling thread's histogram of $site,
+// and when <sys/sdt.h> is available fires the static probe allocator:<site> with the elapsed ticks,
+// e.g. bpftrace -e 'usdt:./cross_alloc_test:allocator:refill { @ = hist(arg0); }'
+// ALLOC_TRACE_FAST_PATH(site) does the same, but drops the sample if the calling thread refilled meanwhile
+// ALLOC_TRACE_NAMED_SCOPE(name, site) is a scope that ALLOC_TRACE_DISMISS(name) keeps from recording
+// ALLOC_TRACE_PROBE(name, arg) fires a bare probe allocator:<name>
+// without ALLOCATOR_TRACE every macro expands to nothing
+
+#ifdef ALLOCATOR_TRACE
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+
+#if __has_include(<x86intrin.h>)
+
+#include <x86intrin.h>
+
+#else
+
+#include <chrono>
+
+#endif
+
+#if __has_include(<sys/sdt.h>)
+
+#include <sys/sdt.h>
+
+#define ALLOC_TRACE_PROBE(name, arg) STAP_PROBE1(allocator, name, arg)
+#else
+#define ALLOC_TRACE_PROBE(name, arg) ((void) (arg))
+#endif
+
+enum AllocSite {
+    // CrossAlloc::alloc served from the free tables, calls that refilled only count under SITE_REFILL
+    SITE_ALLOC,
+    // CrossAlloc::dealloc as a whole
+    SITE_DEALLOC,
+    // a level scan missed and a new origin region was requested
+    SITE_REFILL,
+    // time spent in the page source mapping or unmapping regions
+    SITE_PAGE_SOURCE,
+    // merge_neighbors on release
+    SITE_COALESCE,
+    // BasicHeap::alloc served from the thread cache
+    SITE_CACHE_HIT,
+    SITE_SIZE,
+};
+
+constexpr char const *site2str(AllocSite site) {
+    constexpr char const *names[] = {"alloc", "dealloc", "refill", "page_source", "coalesce", "cache_hit"};
+    return site < SITE_SIZE ? names[site] : "undef";
+}
+
+// log-linear histogram of tick counts, every power of two is cut into SUB buckets,
+// so a reported value is within 1/SUB of the recorded one
+// a single thread writes it, any thread may read it
+class LatencyHistogram {
+public:
+    static constexpr int SUB_BITS = 3;
+    static constexpr int SUB = 1 << SUB_BITS;
+    static constexpr int BUCKETS = (64 - SUB_BITS + 1) * SUB;
+
+    void record(std::uint64_t ticks) {
+        auto &slot = counts[bucket_of(ticks)];
+        slot.store(slot.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        if (ticks > max_ticks.load(std::memory_order_relaxed)) {
+            max_ticks.store(ticks, std::memory_order_relaxed);
+        }
+    }
+
+    void merge(LatencyHistogram const &other) {
+        for (int i = 0; i < BUCKETS; i++) {
+            counts[i].fetch_add(other.counts[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+        auto other_max = other.max_ticks.load(std::memory_order_relaxed);
+        if (other_max > max_ticks.load(std::memory_order_relaxed)) {
+            max_ticks.store(other_max, std::memory_order_relaxed);
+        }
+    }
+
+    std::uint64_t count() const {
+        std::uint64_t total = 0;
+        for (auto &it: counts) {
+            total += it.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+    std::uint64_t max() const {
+        return max_ticks.load(std::memory_order_relaxed);
+    }
+
+    // upper bound of the bucket holding the $quantile (0..1) sample
+    std::uint64_t percentile(double quantile) const {
+        auto total = count();
+        if (total == 0) {
+            return 0;
+        }
+        auto rank = (std::uint64_t) (quantile * (double) (total - 1)) + 1;
+        std::uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; i++) {
+            seen += counts[i].load(std::memory_order_relaxed);
+            if (seen >= rank) {
+                return std::min(bucket_high(i), max());
+            }
+        }
+        return max();
+    }
+
+private:
+    std::atomic<std::uint64_t> counts[BUCKETS]{};
+    std::atomic<std::uint64_t> max_ticks{};
+
+    static int bucket_of(std::uint64_t ticks) {
+        if (ticks < SUB) {
+            return (int) ticks;
+        }
+        int exponent = std::bit_width(ticks) - 1;
+        auto sub = (int) (ticks >> (exponent - SUB_BITS)) & (SUB - 1);
+        return (exponent - SUB_BITS + 1) * SUB + sub;
+    }
+
+    static std::uint64_t bucket_high(int bucket) {
+        if (bucket < SUB) {
+            return bucket;
+        }
+        int exponent = bucket / SUB + SUB_BITS - 1;
+        std::uint64_t sub = bucket % SUB;
+        return ((SUB + sub + 1) << (exponent - SUB_BITS)) - 1;
+    }
+};
+
+class AllocTrace {
+public:
+    AllocTrace() = delete;
+
+    ~AllocTrace() = delete;
+
+    void operator=(AllocTrace const &) = delete;
+
+    // rdtsc where available, steady clock nanoseconds otherwise
+    static std::uint64_t now() {
+#if __has_include(<x86intrin.h>)
+        return __rdtsc();
+#else
+        return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+    }
+
+    static void record(AllocSite site, std::uint64_t ticks) {
+        auto &slot = local();
+        slot.sites[site].record(ticks);
+        if (site == SITE_REFILL) {
+            slot.refills++;
+        }
+    }
+
+    // refills recorded by the calling thread so far
+    static std::uint64_t refills() {
+        return local().refills;
+    }
+
+    // sum of $site over every thread that ever recorded
+    static void snapshot(AllocSite site, LatencyHistogram &out) {
+        for (auto curr = threads.load(std::memory_order_acquire); curr != nullptr; curr = curr->next) {
+            out.merge(curr->sites[site]);
+        }
+    }
+
+    // percentile table of every site, meant for benchmark and test output
+    static void dump(std::ostream &os = std::cout) {
+        os << std::left << std::setw(12) << "site" << std::right
+           << std::setw(12) << "count" << std::setw(10) << "p50" << std::setw(10) << "p90"
+           << std::setw(10) << "p99" << std::setw(10) << "p99.9" << std::setw(14) << "max" << "\n";
+        for (int i = 0; i < SITE_SIZE; i++) {
+            LatencyHistogram total{};
+            snapshot((AllocSite) i, total);
+            os << std::left << std::setw(12) << site2str((AllocSite) i) << std::right
+               << std::setw(12) << total.count()
+               << std::setw(10) << total.percentile(0.5) << std::setw(10) << total.percentile(0.9)
+               << std::setw(10) << total.percentile(0.99) << std::setw(10) << total.percentile(0.999)
+               << std::setw(14) << total.max() << "\n";
+        }
+        os << std::flush;
+    }
+
+private:
+    // histograms of one thread, never freed: an exited thread's slot keeps its counts and is reused by a new thread,
+    // so recording takes no lock and is safe around fork
+    struct ThreadSlot {
+        LatencyHistogram sites[SITE_SIZE]{};
+        // only touched by the owning thread
+        std::uint64_t refills{};
+        std::atomic<bool> in_use{};
+        ThreadSlot *next{};
+    };
+
+    struct SlotOwner {
+        ThreadSlot *slot;
+
+        SlotOwner() : slot{acquire_slot()} {}
+
+        ~SlotOwner() {
+            slot->in_use.store(false, std::memory_order_release);
+        }
+    };
+
+    inline static std::atomic<ThreadSlot *> threads{};
+
+    static ThreadSlot &local() {
+        thread_local SlotOwner owner{};
+        return *owner.slot;
+    }
+
+    static ThreadSlot *acquire_slot() {
+        for (auto curr = threads.load(std::memory_order_acquire); curr != nullptr; curr = curr->next) {
+            bool expected = false;
+            if (curr->in_use.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+                return curr;
+            }
+        }
+        auto slot = new ThreadSlot{};
+        slot->in_use.store(true, std::memory_order_relaxed);
+        slot->next = threads.load(std::memory_order_relaxed);
+        while (!threads.compare_exchange_weak(slot->next, slot, std::memory_order_release)) {}
+        return slot;
+    }
+};
+
+class AllocTraceScope {
+    AllocSite site;
+    std::uint64_t begin;
+    bool dismissed{};
+
+public:
+    explicit AllocTraceScope(AllocSite site) : site{site}, begin{AllocTrace::now()} {}
+
+    void dismiss() {
+        dismissed = true;
+    }
+
+    ~AllocTraceScope() {
+        if (dismissed) {
+            return;
+        }
+        auto ticks = AllocTrace::now() - begin;
+        AllocTrace::record(site, ticks);
+
+        // probe names are tokens, so every site needs its own probe
+        switch (site) {
+            case SITE_ALLOC:
+                ALLOC_TRACE_PROBE(alloc, ticks);
+                break;
+            case SITE_DEALLOC:
+                ALLOC_TRACE_PROBE(dealloc, ticks);
+                break;
+            case SITE_REFILL:
+                ALLOC_TRACE_PROBE(refill, ticks);
+                break;
+            case SITE_PAGE_SOURCE:
+                ALLOC_TRACE_PROBE(page_source, ticks);
+                break;
+            case SITE_COALESCE:
+                ALLOC_TRACE_PROBE(coalesce, ticks);
+                break;
+            case SITE_CACHE_HIT:
+                ALLOC_TRACE_PROBE(cache_hit, ticks);
+                break;
+            default:
+                break;
+        }
+    }
+
+    AllocTraceScope(AllocTraceScope const &) = delete;
+
+    void operator=(AllocTraceScope const &) = delete;
+};
+
+// the members are destroyed after the body, so the refill count is compared before the sample is taken
+class AllocFastPathScope {
+    AllocTraceScope scope;
+    std::uint64_t refills;
+
+public:
+    explicit AllocFastPathScope(AllocSite site) : scope{site}, refills{AllocTrace::refills()} {}
+
+    ~AllocFastPathScope() {
+        if (AllocTrace::refills() != refills) {
+            scope.dismiss();
+        }
+    }
+
+    AllocFastPathScope(AllocFastPathScope const &) = delete;
+
+    void operator=(AllocFastPathScope const &) = delete;
+};
+
+#define ALLOC_TRACE_CONCAT_(a, b) a##b
+#define ALLOC_TRACE_CONCAT(a, b) ALLOC_TRACE_CONCAT_(a, b)
+#define ALLOC_TRACE_SCOPE(site) AllocTraceScope ALLOC_TRACE_CONCAT(alloc_trace_scope_, __LINE__){site}
+#define ALLOC_TRACE_FAST_PATH(site) AllocFastPathScope ALLOC_TRACE_CONCAT(alloc_trace_scope_, __LINE__){site}
+#define ALLOC_TRACE_NAMED_SCOPE(name, site) AllocTraceScope name{site}
+#define ALLOC_TRACE_DISMISS(name) name.dismiss()
+
+#else
+
+#define ALLOC_TRACE_PROBE(name, arg) ((void) 0)
+#define ALLOC_TRACE_SCOPE(site) ((void) 0)
+#define ALLOC_TRACE_FAST_PATH(site) ((void) 0)
+#define ALLOC_TRACE_NAMED_SCOPE(name, site) ((void) 0)
+#define ALLOC_TRACE_DISMISS(name) ((void) 0)
+
+#endif
+
+#endif //ALLOCATOR_ALLOC_TRACE_H
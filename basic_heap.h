@@ -0,0 +1,341 @@
+//
+// Created by PinkLure on 9/10/2022.
+//
+
+#ifndef ALLOCATOR_BASIC_HEAP_H
+#define ALLOCATOR_BASIC_HEAP_H
+
+#include "memory_hierachy.h"
+#include "page_source.h"
+#include "fork_safety.h"
+#include "mini_alloc.h"
+#include "cross_alloc.h"
+#include "thread_cache.h"
+#include "alloc_trace.h"
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <type_traits>
+
+// BasicHeap composes an allocator out of compile-time policies:
+//
+//   SizeClassMap : how small requests are rounded and where the small/large split is
+//                  static Hierachy classify(std::size_t size); static std::size_t class_size(Hierachy level);
+//                  static constexpr std::size_t SMALL_LIMIT;
+//   SmallEngine  : engine serving requests <= SMALL_LIMIT
+//   LargeEngine  : engine serving everything above
+//                  void *alloc(std::size_t size); void dealloc(void *mem);
+//                  an engine with members is serialized by the heap lock,
+//                  an empty one is stateless or guards its own state and is called without it
+//   ThreadCache  : per-thread front of the small engine, also picks the heap Lock type
+//   Stats        : counters fed on every alloc/dealloc, empty policies cost nothing
+//
+// Nothing on the hot path is virtual, every configuration is a distinct type.
+
+
+// ============================ size class maps =========================================
+
+template<Hierachy SMALL_LEVEL = Hierachy::K32>
+struct HierachyClassMap {
+    static constexpr std::size_t SMALL_LIMIT = level2size(SMALL_LEVEL);
+
+    static Hierachy classify(std::size_t size) {
+        return size2level_allocate(size);
+    }
+
+    static std::size_t class_size(Hierachy level) {
+        return level2size(level);
+    }
+};
+
+
+// ============================ engines =========================================
+
+// instance-based first-fit engine, keeps its own page list
+// MiniAlloc takes its regions from new char[], so there is no page source to choose
+class MiniEngine {
+    MiniAlloc mini{0};
+
+public:
+    void *alloc(std::size_t size) {
+        return mini.alloc(size);
+    }
+
+    void dealloc(void *mem) {
+        mini.dealloc(mem);
+    }
+};
+
+// forwards to the process-wide CrossAlloc tables, which own their origin regions
+// every heap built on it shares the same state, so use a single instance per process
+// CrossAlloc maps through SystemPageSource and locks itself
+struct CrossEngine {
+    static void *alloc(std::size_t size) {
+        return CrossAlloc::alloc(size);
+    }
+
+    static void dealloc(void *mem) {
+        CrossAlloc::dealloc(mem);
+    }
+};
+
+// maps every request straight from the page source, size is kept in a header like CrossAlloc does
+template<typename PageSource>
+struct PageEngine {
+    static void *alloc(std::size_t size) {
+        auto real_size = ceil_divide(size + sizeof(std::size_t), PAGE_SIZE) * PAGE_SIZE;
+        auto mem = PageSource::map(real_size);
+        if (mem == nullptr) {
+            return nullptr;
+        }
+        *((std::size_t *) mem) = real_size;
+        return mem + sizeof(std::size_t);
+    }
+
+    static void dealloc(void *mem) {
+        auto real_mem = (std::byte *) mem - sizeof(std::size_t);
+        PageSource::unmap(real_mem, *(std::size_t *) real_mem);
+    }
+};
+
+
+// ============================ thread caches =========================================
+
+struct NullLock {
+    void lock() {}
+
+    void unlock() {}
+};
+
+// single-threaded: no cache, no locking
+struct NoThreadCache {
+    using Lock = NullLock;
+
+    template<typename Heap>
+    struct Bins {
+        struct Registry {
+            void reclaim_dead() {}
+
+            void release_all(Heap &) {}
+
+            bool has_orphans() const {
+                return false;
+            }
+
+            void release_orphans(Heap &) {}
+        };
+
+        static void *pop(Heap &, Hierachy) {
+            return nullptr;
+        }
+
+        static bool push(Heap &, Hierachy, void *) {
+            return false;
+        }
+    };
+};
+
+// keeps up to CAPACITY freed blocks per class and thread, see thread_cache.h
+template<std::size_t CAPACITY = 64>
+struct TlsThreadCache {
+    using Lock = std::mutex;
+
+    template<typename Heap>
+    struct Bins {
+        using Registry = ThreadCacheRegistry<Heap, Hierachy::SIZE>;
+
+        static void *pop(Heap &heap, Hierachy level) {
+            auto &cache = Registry::local();
+            return cache.bound() == &heap ? cache.pop(level) : nullptr;
+        }
+
+        static bool push(Heap &heap, Hierachy level, void *mem) {
+            auto &cache = Registry::local();
+            if (cache.bound() == nullptr) {
+                std::lock_guard guard{heap.lock};
+                heap.caches.claim(heap, cache);
+            }
+            if (cache.bound() != &heap || cache.count(level) >= CAPACITY) {
+                return false;
+            }
+            cache.push(level, mem);
+            return true;
+        }
+    };
+};
+
+
+// ============================ stats =========================================
+
+struct NoStats {
+    void on_alloc(std::size_t) {}
+
+    void on_dealloc(std::size_t) {}
+};
+
+struct CountingStats {
+    std::atomic<std::size_t> alloc_count{};
+    std::atomic<std::size_t> dealloc_count{};
+    std::atomic<std::size_t> live_bytes{};
+
+    void on_alloc(std::size_t size) {
+        alloc_count.fetch_add(1, std::memory_order_relaxed);
+        live_bytes.fetch_add(size, std::memory_order_relaxed);
+    }
+
+    void on_dealloc(std::size_t size) {
+        dealloc_count.fetch_add(1, std::memory_order_relaxed);
+        live_bytes.fetch_sub(size, std::memory_order_relaxed);
+    }
+};
+
+
+// ============================ heap =========================================
+
+template<typename SizeClassMap,
+        typename SmallEngine,
+        typename LargeEngine,
+        typename ThreadCache = NoThreadCache,
+        typename Stats = NoStats>
+class BasicHeap {
+    using Cache = typename ThreadCache::template Bins<BasicHeap>;
+    friend Cache;
+    friend typename Cache::Registry;
+
+    [[no_unique_address]] SmallEngine small{};
+    [[no_unique_address]] LargeEngine large{};
+    [[no_unique_address]] typename ThreadCache::Lock lock{};
+    [[no_unique_address]] typename Cache::Registry caches{};
+    [[no_unique_address]] Stats counters{};
+
+    // a heap without locks has nothing to quiesce across fork
+    static constexpr bool FORK_HOOKED = !std::is_same_v<typename ThreadCache::Lock, NullLock>;
+    ForkHook fork_hook{
+            FORK_LAYER_CACHE, this,
+            [](void *self) { ((BasicHeap *) self)->lock.lock(); },
+            [](void *self) { ((BasicHeap *) self)->lock.unlock(); },
+            [](void *self) {
+                auto heap = (BasicHeap *) self;
+                heap->caches.reclaim_dead();
+                heap->lock.unlock();
+            },
+    };
+
+    // caller holds lock
+    void release_cached(CacheLink *list) {
+        while (list != nullptr) {
+            auto next = list->next;
+            small.dealloc(list);
+            list = next;
+        }
+    }
+
+    // blocks of threads that did not survive a fork go back to the small engine
+    void release_orphans() {
+        if (caches.has_orphans()) {
+            std::lock_guard guard{lock};
+            caches.release_orphans(*this);
+        }
+    }
+
+    template<typename Engine>
+    void *engine_alloc(Engine &engine, std::size_t size) {
+        if constexpr (std::is_empty_v<Engine>) {
+            return engine.alloc(size);
+        } else {
+            std::lock_guard guard{lock};
+            return engine.alloc(size);
+        }
+    }
+
+    template<typename Engine>
+    void engine_dealloc(Engine &engine, void *mem) {
+        if constexpr (std::is_empty_v<Engine>) {
+            engine.dealloc(mem);
+        } else {
+            std::lock_guard guard{lock};
+            engine.dealloc(mem);
+        }
+    }
+
+public:
+    BasicHeap() {
+        if constexpr (FORK_HOOKED) {
+            ForkRegistry::attach(&fork_hook);
+        }
+    }
+
+    // blocks still cached by any thread go back to the small engine
+    ~BasicHeap() {
+        if constexpr (FORK_HOOKED) {
+            ForkRegistry::detach(&fork_hook);
+        }
+        std::lock_guard guard{lock};
+        caches.release_all(*this);
+    }
+
+    BasicHeap(BasicHeap const &) = delete;
+
+    void operator=(BasicHeap const &) = delete;
+
+    [[nodiscard]] void *alloc(std::size_t size) {
+        if (size == 0) {
+            return nullptr;
+        }
+        counters.on_alloc(size);
+
+        if (size > SizeClassMap::SMALL_LIMIT) {
+            return engine_alloc(large, size);
+        }
+
+        // always ask the engine for the whole class, so any cached block of the class fits
+        auto level = SizeClassMap::classify(size);
+        ALLOC_TRACE_NAMED_SCOPE(cache_hit, SITE_CACHE_HIT);
+        if (auto mem = Cache::pop(*this, level); mem != nullptr) {
+            return mem;
+        }
+        ALLOC_TRACE_DISMISS(cache_hit);
+        release_orphans();
+        return engine_alloc(small, SizeClassMap::class_size(level));
+    }
+
+    // $size must be the size passed to alloc
+    void dealloc(void *mem, std::size_t size) {
+        if (mem == nullptr) {
+            return;
+        }
+        counters.on_dealloc(size);
+
+        if (size > SizeClassMap::SMALL_LIMIT) {
+            engine_dealloc(large, mem);
+            return;
+        }
+
+        if (Cache::push(*this, SizeClassMap::classify(size), mem)) {
+            return;
+        }
+        release_orphans();
+        engine_dealloc(small, mem);
+    }
+
+    Stats const &stats() const {
+        return counters;
+    }
+};
+
+
+// ============================ presets =========================================
+
+// single-threaded, no cache, no counters
+using TinyHeap = BasicHeap<HierachyClassMap<>, MiniEngine, MiniEngine>;
+
+#if __has_include(<sys/mman.h>)
+
+// thread caches in front of CrossAlloc, large blocks mapped directly
+using ConcurrentHeap = BasicHeap<HierachyClassMap<>, CrossEngine, PageEngine<MmapPageSource>,
+        TlsThreadCache<>, CountingStats>;
+
+#endif
+
+#endif //ALLOCATOR_BASIC_HEAP_H
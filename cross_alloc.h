@@ -5,14 +5,23 @@
 #ifndef ALLOCATOR_CROSS_ALLOC_H
 #define ALLOCATOR_CROSS_ALLOC_H
 
-#include"memory_hierachy.h"
+#include "memory_hierachy.h"
+#include "page_source.h"
+#include "fork_safety.h"
+#include "alloc_trace.h"
 #include "3rd/ansi-color.h"
 
+#include <algorithm>
+#include <cstdint>
 #include <sstream>
 #include <iostream>
 #include <limits>
+#include <mutex>
+#include <new>
 #include <vector>
 
+// blocks up to K32 are split from shared origin regions under one lock,
+// larger blocks get a region of their exact level each and only take the lock of that level
 class CrossAlloc {
 public:
     CrossAlloc() = delete;
@@ -25,14 +34,43 @@ public:
 
     static bool dealloc(void *mem);
 
+    // allocate $count blocks of $size bytes into $out_ptrs, blocks are carved from one free span at a time
+    // return the number of blocks written
+    static std::size_t alloc_bulk(std::size_t size, std::size_t count, void **out_ptrs);
+
+    // release $count blocks with one walk of the allocated list per level
+    // return the number of blocks freed, unknown pointers are skipped
+    static std::size_t free_bulk(void **ptrs, std::size_t count);
+
     static void print_table(bool free);
 
     static void print_origin_vec();
 
     static void visualize();
 
+    struct OriginReport {
+        std::byte *mem;
+        std::size_t size;
+        std::size_t used;
+        std::size_t free;
+        std::size_t free_nodes;
+        std::size_t largest_free;
+    };
+
+    // occupancy and free-space layout of every live origin region
+    static std::vector<OriginReport> fragmentation_report();
+
+    static void print_fragmentation();
+
+    // hand memory back to the system until $target_bytes are returned:
+    // fully free origin regions are released first, then free pages of the sparsest regions are decommitted
+    // return the bytes returned by this call
+    static std::size_t trim(std::size_t target_bytes = std::numeric_limits<std::size_t>::max());
+
 private:
 
+    struct OriginNode;
+
     struct MemoryNode {
         // managed memory size
         std::size_t size{};
@@ -54,6 +92,12 @@ private:
         // if is in free-list
         bool is_free;
 
+        // false once trim decommitted its pages, they fault back in when touched
+        bool committed{true};
+
+        // origin region this node was cut from
+        OriginNode *origin{};
+
         MemoryNode(Hierachy level, bool is_free)
                 : level{level}, is_free{is_free} {};
 
@@ -70,26 +114,88 @@ private:
         // this func will handle node's list relations
         static MemoryNode *divide_node(MemoryNode *source, std::size_t ceil_size);
 
+        // carve up to $count blocks of $ceil_size from the tail of $source
+        // and splice them into allocated list at once, write user pointers to $out
+        // return the number of blocks carved
+        static std::size_t divide_bulk(MemoryNode *source, std::size_t ceil_size, std::size_t count, void **out);
+
         // don't touch $node after invoke this func
         // return the merged node or nullptr
         static MemoryNode *merge_neighbors(MemoryNode *node);
 
     };
 
+    // a released region keeps its slot with mem == nullptr until it is reused,
+    // such slots are chained by next_free
     struct OriginNode {
-        std::size_t size;
-        std::byte *mem;
-//        MemoryNode *next;
+        std::size_t size{};
+        std::byte *mem{};
 
-        explicit OriginNode(std::size_t sz)
-                : size{sz}, mem{new std::byte[sz]} {};
+        // bytes currently allocated out of this region
+        std::size_t used{};
 
+        // node at the region start, merges keep the lower node and splits cut from the tail,
+        // so it lives as long as the region
+        MemoryNode *head{};
+
+        OriginNode *next_free{};
     };
 
+    // origin regions are registered in fixed chunks that never move, so MemoryNode::origin stays valid
+    // while other threads register new regions
+    struct OriginChunk {
+        static constexpr std::size_t CAPACITY = 64;
+
+        OriginNode nodes[CAPACITY]{};
+        OriginChunk *next{};
+    };
+
+    // candidates compared per level when picking the densest region
+    static constexpr int DENSEST_SCAN = 8;
+
+    // first level served by the large path
+    static constexpr Hierachy LARGE_LEVEL = Hierachy::K64;
+
 private:
     static MemoryNode free_table[Hierachy::SIZE];
     static MemoryNode allocated_table[Hierachy::SIZE];
-    inline static std::vector<OriginNode> origin_vec{};
+    static OriginChunk origin_chunks;
+    // slot lookup is O(1): released slots are reused first, then the next never used slot of the last chunk
+    inline static OriginNode *free_origins{};
+    inline static OriginChunk *last_chunk{&origin_chunks};
+    inline static std::size_t last_chunk_used{};
+
+    // small_lock guards every level below LARGE_LEVEL and their regions,
+    // level_locks[i] guards free_table[i], allocated_table[i] and the regions of level i from LARGE_LEVEL on,
+    // origin_lock guards the chunk registry
+    // lock order: small_lock -> origin_lock -> level_locks ascending
+    inline static std::mutex small_lock{};
+    inline static std::mutex origin_lock{};
+    inline static std::mutex level_locks[Hierachy::SIZE]{};
+
+    // take every lock above in lock order, for whole-heap walks and fork
+    static void lock_all();
+
+    static void unlock_all();
+
+    struct AllLocks {
+        AllLocks() {
+            lock_all();
+        }
+
+        ~AllLocks() {
+            unlock_all();
+        }
+    };
+
+    // quiesce the whole heap across fork, see fork_safety.h
+    inline static ForkHook fork_hook{
+            FORK_LAYER_ENGINE, nullptr,
+            [](void *) { lock_all(); },
+            [](void *) { unlock_all(); },
+            [](void *) { unlock_all(); },
+    };
+    inline static bool const fork_attached = (ForkRegistry::attach(&fork_hook), true);
 
 private:
     // request memory from system
@@ -97,14 +203,37 @@ private:
 
     static void request_memory(Hierachy level);
 
+    // map a region of $size and register it, return its head node covering the whole region
+    // the head starts out allocated if $allocated, the caller links it into a table
+    static MemoryNode *map_origin(std::size_t size, Hierachy level, bool allocated);
+
+    // unmap a fully free region and free its slot, caller holds origin_lock and the lock of the region
+    static void unmap_origin(OriginNode &origin);
+
+    // call $f on every registered region, caller holds origin_lock
+    template<typename F>
+    static void for_each_origin(F &&f);
+
+    // small path, free node can hold $ceil_size, or nullptr
+    // among the first candidates of the level the one in the densest region wins, so sparse regions drain
+    static MemoryNode *find_free(std::size_t ceil_size);
+
+    static double density(MemoryNode *node);
+
     // acquire free node by size
     static MemoryNode *acquire_free(std::size_t size);
 
+    // large path, reuse a free block of the level or map a new one, takes level_locks[level] only
+    static MemoryNode *acquire_large(std::size_t ceil_size);
+
     // search node by ptr and size in allocated_table
     static MemoryNode *search_allocated(void *mem, std::size_t size);
 
     // release an allocated node to free, and try to merge neighbors
     static void release_allocated(MemoryNode *node);
+
+    // large blocks go back to the free list of their level as a whole
+    static void release_large(MemoryNode *node);
 };
 
 
@@ -112,14 +241,19 @@ private:
 
 
 inline void *CrossAlloc::alloc(std::size_t size) {
-    if (size == 0 || size > level2size(Hierachy::G512)) {
+    ALLOC_TRACE_FAST_PATH(SITE_ALLOC);
+    if (size == 0 || size > level2size(Hierachy::G512) - MIN_UNIT) {
         return nullptr;
     }
 
-    auto node = acquire_free(size);
-//    if (node == nullptr) {
-//        return nullptr;
-//    }
+    MemoryNode *node;
+    auto ceil_size = (ceil_divide(size, MIN_UNIT) + 1) * MIN_UNIT;
+    if (size2level_allocate(ceil_size) >= LARGE_LEVEL) {
+        node = acquire_large(ceil_size);
+    } else {
+        std::lock_guard guard{small_lock};
+        node = acquire_free(size);
+    }
 
     assert(sizeof(std::size_t) == MIN_UNIT);
     *((std::size_t *) node->mem) = node->size;
@@ -127,13 +261,25 @@ inline void *CrossAlloc::alloc(std::size_t size) {
 }
 
 inline bool CrossAlloc::dealloc(void *mem) {
+    ALLOC_TRACE_SCOPE(SITE_DEALLOC);
     if (mem == nullptr) {
         return false;
     }
     auto real_mem = (std::byte *) mem - sizeof(std::size_t);
     auto size = *(std::size_t *) real_mem;
 
-//    auto size = *(std::size_t *) ((std::byte *) mem - sizeof(std::size_t));
+    auto level = size2level_classify(size);
+    if (level >= LARGE_LEVEL) {
+        std::lock_guard guard{level_locks[level]};
+        auto node = search_allocated(real_mem, size);
+        if (node == nullptr) {
+            return false;
+        }
+        release_large(node);
+        return true;
+    }
+
+    std::lock_guard guard{small_lock};
     auto node = search_allocated(real_mem, size);
     if (node == nullptr) {
         return false;
@@ -142,10 +288,157 @@ inline bool CrossAlloc::dealloc(void *mem) {
     return true;
 }
 
-template<typename UINT>
-requires (std::numeric_limits<UINT>::is_integer && !std::numeric_limits<UINT>::is_signed)
-inline UINT ceil_divide(UINT x, UINT y) {
-    return x == 0 ? 0 : 1 + (x - 1) / y;
+inline std::size_t CrossAlloc::alloc_bulk(std::size_t size, std::size_t count, void **out_ptrs) {
+    if (size == 0 || size > level2size(Hierachy::G512) - MIN_UNIT || out_ptrs == nullptr) {
+        return 0;
+    }
+
+    std::size_t done = 0;
+    auto ceil_size = (ceil_divide(size, MIN_UNIT) + 1) * MIN_UNIT;
+    if (size2level_allocate(ceil_size) >= LARGE_LEVEL) {
+        // every large block owns its region, there is nothing to carve
+        for (; done < count; done++) {
+            out_ptrs[done] = alloc(size);
+        }
+        return done;
+    }
+
+    // small spans never exceed the level below LARGE_LEVEL
+    constexpr auto span_limit = level2size(static_cast<Hierachy>(LARGE_LEVEL - 1));
+    std::lock_guard guard{small_lock};
+    while (done < count) {
+        // prefer a span holding the whole remaining batch, then any span holding one block
+        auto fit = std::min(count - done, span_limit / ceil_size);
+        auto node = find_free(fit * ceil_size);
+        if (node == nullptr) {
+            node = find_free(ceil_size);
+        }
+
+        if (node == nullptr) {
+            auto page_ceil_size = ceil_divide(fit * ceil_size, PAGE_SIZE) * PAGE_SIZE;
+            auto page_level = size2level_allocate(page_ceil_size);
+
+            request_memory(page_level);
+
+            node = free_table[page_level].list_next;
+        }
+
+        done += MemoryNode::divide_bulk(node, ceil_size, count - done, out_ptrs + done);
+    }
+    return done;
+}
+
+inline std::size_t CrossAlloc::free_bulk(void **ptrs, std::size_t count) {
+    if (ptrs == nullptr || count == 0) {
+        return 0;
+    }
+
+    std::vector<std::byte *> real_mems{};
+    real_mems.reserve(count);
+    std::uint64_t level_mask{};
+    static_assert(Hierachy::SIZE <= 64);
+    for (std::size_t i = 0; i < count; i++) {
+        if (ptrs[i] == nullptr) {
+            continue;
+        }
+        auto real_mem = (std::byte *) ptrs[i] - sizeof(std::size_t);
+        level_mask |= std::uint64_t{1} << size2level_classify(*(std::size_t *) real_mem);
+        real_mems.push_back(real_mem);
+    }
+    std::sort(real_mems.begin(), real_mems.end());
+
+    // an address freed at one level may be handed out again at another level by a concurrent alloc,
+    // so every pointer is matched at most once, and the small levels are walked under one hold of small_lock
+    std::vector<bool> released(real_mems.size());
+    std::size_t freed = 0;
+    auto release_level = [&](int i) {
+        auto curr = allocated_table[i].list_next;
+        while (curr != nullptr) {
+            auto next = curr->list_next;
+            auto it = std::lower_bound(real_mems.begin(), real_mems.end(), curr->mem);
+            auto index = it - real_mems.begin();
+            if (it != real_mems.end() && *it == curr->mem && !released[index]) {
+                released[index] = true;
+                if (i < LARGE_LEVEL) {
+                    release_allocated(curr);
+                } else {
+                    release_large(curr);
+                }
+                freed++;
+            }
+            curr = next;
+        }
+    };
+
+    if ((level_mask & ((std::uint64_t{1} << LARGE_LEVEL) - 1)) != 0) {
+        std::lock_guard guard{small_lock};
+        for (int i = 0; i < LARGE_LEVEL; i++) {
+            if ((level_mask & (std::uint64_t{1} << i)) != 0) {
+                release_level(i);
+            }
+        }
+    }
+    for (int i = LARGE_LEVEL; i < Hierachy::SIZE; i++) {
+        if ((level_mask & (std::uint64_t{1} << i)) != 0) {
+            std::lock_guard guard{level_locks[i]};
+            release_level(i);
+        }
+    }
+    return freed;
+}
+
+inline std::size_t CrossAlloc::trim(std::size_t target_bytes) {
+    std::size_t returned = 0;
+    std::lock_guard small_guard{small_lock};
+    std::lock_guard origin_guard{origin_lock};
+
+    // fully free regions have merged back into their head node
+    for_each_origin([&](OriginNode &origin) {
+        if (returned >= target_bytes) {
+            return;
+        }
+        auto level = size2level_classify(origin.size);
+        if (level >= LARGE_LEVEL) {
+            std::lock_guard guard{level_locks[level]};
+            if (origin.used == 0) {
+                returned += origin.size;
+                unmap_origin(origin);
+            }
+        } else if (origin.used == 0) {
+            returned += origin.size;
+            unmap_origin(origin);
+        }
+    });
+
+    // every large region still registered is in use, only small regions hold free nodes
+    std::vector<OriginNode *> sparse{};
+    for_each_origin([&](OriginNode &origin) {
+        if (size2level_classify(origin.size) < LARGE_LEVEL) {
+            sparse.push_back(&origin);
+        }
+    });
+    std::sort(sparse.begin(), sparse.end(), [](OriginNode *x, OriginNode *y) {
+        return density(x->head) < density(y->head);
+    });
+
+    // only whole pages inside a free node can be decommitted
+    for (auto origin: sparse) {
+        for (auto curr = origin->head; curr != nullptr; curr = curr->origin_next) {
+            if (returned >= target_bytes) {
+                return returned;
+            }
+            if (!curr->is_free || !curr->committed) {
+                continue;
+            }
+            auto begin = ceil_divide((std::uintptr_t) curr->mem, (std::uintptr_t) PAGE_SIZE) * PAGE_SIZE;
+            auto end = (std::uintptr_t) (curr->mem + curr->size) / PAGE_SIZE * PAGE_SIZE;
+            if (end > begin && SystemPageSource::decommit((std::byte *) begin, end - begin)) {
+                curr->committed = false;
+                returned += end - begin;
+            }
+        }
+    }
+    return returned;
 }
 
 inline void CrossAlloc::request_memory(std::size_t size) {
@@ -156,26 +449,105 @@ inline void CrossAlloc::request_memory(std::size_t size) {
 }
 
 inline void CrossAlloc::request_memory(Hierachy level) {
-    auto real_size = level2size(level);
-    origin_vec.emplace_back(real_size);
-    auto &back = origin_vec.back();
-    auto node = new MemoryNode(real_size, back.mem, level);
-//    back.next = node;
+    ALLOC_TRACE_SCOPE(SITE_REFILL);
+    auto node = map_origin(level2size(level), level, false);
     free_table[level].insert_after(node);
 }
 
+inline CrossAlloc::MemoryNode *CrossAlloc::map_origin(std::size_t size, Hierachy level, bool allocated) {
+    // map before taking the registry lock, it may fault in or block on the system
+    std::byte *mem;
+    {
+        ALLOC_TRACE_SCOPE(SITE_PAGE_SOURCE);
+        mem = SystemPageSource::map(size);
+    }
+    if (mem == nullptr) {
+        throw std::bad_alloc{};
+    }
+    auto node = new MemoryNode(size, mem, level);
+    node->is_free = !allocated;
+
+    std::lock_guard guard{origin_lock};
+    // reuse the slot of a trimmed region before growing
+    OriginNode *slot;
+    if (free_origins != nullptr) {
+        slot = free_origins;
+        free_origins = slot->next_free;
+        slot->next_free = nullptr;
+    } else {
+        if (last_chunk_used == OriginChunk::CAPACITY) {
+            last_chunk->next = new OriginChunk{};
+            last_chunk = last_chunk->next;
+            last_chunk_used = 0;
+        }
+        slot = &last_chunk->nodes[last_chunk_used++];
+    }
+
+    slot->size = size;
+    slot->mem = mem;
+    slot->used = allocated ? size : 0;
+    slot->head = node;
+    node->origin = slot;
+    return node;
+}
+
+inline void CrossAlloc::unmap_origin(OriginNode &origin) {
+    auto head = origin.head;
+    assert(head->is_free && head->size == origin.size);
+    head->detach_from_list();
+    delete head;
+    {
+        ALLOC_TRACE_SCOPE(SITE_PAGE_SOURCE);
+        SystemPageSource::unmap(origin.mem, origin.size);
+    }
+    origin = OriginNode{};
+    origin.next_free = free_origins;
+    free_origins = &origin;
+}
+
+template<typename F>
+inline void CrossAlloc::for_each_origin(F &&f) {
+    for (auto chunk = &origin_chunks; chunk != nullptr; chunk = chunk->next) {
+        for (auto &origin: chunk->nodes) {
+            if (origin.mem != nullptr) {
+                f(origin);
+            }
+        }
+    }
+}
+
+inline CrossAlloc::MemoryNode *CrossAlloc::find_free(std::size_t ceil_size) {
+    for (int i = size2level_allocate(ceil_size); i < LARGE_LEVEL; i++) {
+        auto curr = free_table[i].list_next;
+        if (curr == nullptr) {
+            continue;
+        }
+
+        auto best = curr;
+        auto best_density = density(curr);
+        for (int n = 1; n < DENSEST_SCAN && (curr = curr->list_next) != nullptr; n++) {
+            auto curr_density = density(curr);
+            if (curr_density > best_density) {
+                best = curr;
+                best_density = curr_density;
+            }
+        }
+        return best;
+    }
+    return nullptr;
+}
+
+inline double CrossAlloc::density(MemoryNode *node) {
+    return (double) node->origin->used / (double) node->origin->size;
+}
+
 inline CrossAlloc::MemoryNode *CrossAlloc::acquire_free(std::size_t size) {
     assert(size != 0 && size <= level2size(Hierachy::G512));
     auto ceil_size = (ceil_divide(size, MIN_UNIT) + 1) * MIN_UNIT;
-    MemoryNode *node{};
-    for (int i = size2level_allocate(ceil_size); i < Hierachy::SIZE; i++) {
-        if (free_table[i].list_next != nullptr) {
-            node = free_table[i].list_next;
-            break;
-        }
-    }
+    auto node = find_free(ceil_size);
 
     if (node == nullptr) {
+        ALLOC_TRACE_PROBE(acquire_miss, ceil_size);
         auto page_ceil_size = ceil_divide(ceil_size, PAGE_SIZE) * PAGE_SIZE;
         auto page_level = size2level_allocate(page_ceil_size);
 
@@ -187,6 +559,30 @@ inline CrossAlloc::MemoryNode *CrossAlloc::acquire_free(std::size_t size) {
     return MemoryNode::divide_node(node, ceil_size);
 }
 
+inline CrossAlloc::MemoryNode *CrossAlloc::acquire_large(std::size_t ceil_size) {
+    auto level = size2level_allocate(ceil_size);
+    {
+        std::lock_guard guard{level_locks[level]};
+        auto node = free_table[level].list_next;
+        if (node != nullptr) {
+            node->detach_from_list();
+            node->is_free = false;
+            node->committed = true;
+            node->origin->used = node->size;
+            allocated_table[level].insert_after(node);
+            return node;
+        }
+    }
+
+    // map without the level lock, other threads of this level keep going
+    ALLOC_TRACE_PROBE(acquire_miss, ceil_size);
+    ALLOC_TRACE_SCOPE(SITE_REFILL);
+    auto node = map_origin(level2size(level), level, true);
+    std::lock_guard guard{level_locks[level]};
+    allocated_table[level].insert_after(node);
+    return node;
+}
+
 inline CrossAlloc::MemoryNode *CrossAlloc::search_allocated(void *mem, std::size_t size) {
     auto curr = allocated_table[size2level_classify(size)].list_next;
     while (curr != nullptr && curr->mem != mem) {
@@ -196,12 +592,40 @@ inline CrossAlloc::MemoryNode *CrossAlloc::search_allocated(void *mem, std::size
 }
 
 inline void CrossAlloc::release_allocated(MemoryNode *node) {
+    node->origin->used -= node->size;
     node->detach_from_list();
     node->is_free = true;
-    auto res = MemoryNode::merge_neighbors(node);
+    MemoryNode *res;
+    {
+        ALLOC_TRACE_SCOPE(SITE_COALESCE);
+        res = MemoryNode::merge_neighbors(node);
+    }
     free_table[res->level].insert_after(res);
 }
 
+inline void CrossAlloc::release_large(MemoryNode *node) {
+    node->detach_from_list();
+    node->is_free = true;
+    node->origin->used = 0;
+    free_table[node->level].insert_after(node);
+}
+
+inline void CrossAlloc::lock_all() {
+    small_lock.lock();
+    origin_lock.lock();
+    for (int i = LARGE_LEVEL; i < Hierachy::SIZE; i++) {
+        level_locks[i].lock();
+    }
+}
+
+inline void CrossAlloc::unlock_all() {
+    for (int i = Hierachy::SIZE - 1; i >= LARGE_LEVEL; i--) {
+        level_locks[i].unlock();
+    }
+    origin_lock.unlock();
+    small_lock.unlock();
+}
+
 
 inline void CrossAlloc::MemoryNode::insert_after(MemoryNode *node) {
     node->list_prev = this;
@@ -225,7 +649,7 @@ inline void CrossAlloc::MemoryNode::detach_from_list() {
 }
 
 inline CrossAlloc::MemoryNode *CrossAlloc::MemoryNode::divide_node(MemoryNode *source, std::size_t ceil_size) {
-    assert(ceil_size != 0 && ceil_size < source->size);
+    assert(ceil_size != 0 && ceil_size <= source->size);
     MemoryNode *res;
 
     source->detach_from_list();
@@ -238,6 +662,7 @@ inline CrossAlloc::MemoryNode *CrossAlloc::MemoryNode::divide_node(MemoryNode *s
         free_table[source->level].insert_after(source);
 
         res = new MemoryNode(ceil_size, source->mem + source->size, size2level_classify(ceil_size));
+        res->origin = source->origin;
         res->origin_prev = source;
         res->origin_next = source->origin_next;
         if (source->origin_next != nullptr) {
@@ -248,10 +673,75 @@ inline CrossAlloc::MemoryNode *CrossAlloc::MemoryNode::divide_node(MemoryNode *s
         res->is_free = false;
     }
 
+    res->committed = true;
+    res->origin->used += res->size;
     allocated_table[res->level].insert_after(res);
     return res;
 }
 
+inline std::size_t
+CrossAlloc::MemoryNode::divide_bulk(MemoryNode *source, std::size_t ceil_size, std::size_t count, void **out) {
+    assert(ceil_size != 0 && ceil_size <= source->size);
+    auto n = std::min(count, source->size / ceil_size);
+    auto level = size2level_classify(ceil_size);
+
+    source->detach_from_list();
+    source->size -= n * ceil_size;
+    if (source->size != 0) {
+        source->level = size2level_classify(source->size);
+        free_table[source->level].insert_after(source);
+    }
+
+    MemoryNode *first{};
+    MemoryNode *last{};
+    auto cursor = source->mem + source->size;
+    for (std::size_t i = 0; i < n; i++, cursor += ceil_size) {
+        MemoryNode *block;
+        if (i == 0 && source->size == 0) {
+            // the whole span is consumed, reuse $source as the first block
+            block = source;
+            block->size = ceil_size;
+            block->level = level;
+        } else {
+            block = new MemoryNode(ceil_size, cursor, level);
+            block->origin = source->origin;
+            auto anchor = last == nullptr ? source : last;
+            block->origin_prev = anchor;
+            block->origin_next = anchor->origin_next;
+            if (anchor->origin_next != nullptr) {
+                anchor->origin_next->origin_prev = block;
+            }
+            anchor->origin_next = block;
+        }
+        block->is_free = false;
+        block->committed = true;
+
+        // chain blocks in address order, the chain is spliced below
+        block->list_prev = last;
+        if (last == nullptr) {
+            first = block;
+        } else {
+            last->list_next = block;
+        }
+        last = block;
+
+        *((std::size_t *) block->mem) = block->size;
+        out[i] = block->mem + sizeof(std::size_t);
+    }
+
+    source->origin->used += n * ceil_size;
+    if (first != nullptr) {
+        auto &head = allocated_table[level];
+        last->list_next = head.list_next;
+        if (head.list_next != nullptr) {
+            head.list_next->list_prev = last;
+        }
+        head.list_next = first;
+        first->list_prev = &head;
+    }
+    return n;
+}
+
 inline CrossAlloc::MemoryNode *CrossAlloc::MemoryNode::merge_neighbors(MemoryNode *node) {
     if (node == nullptr) {
         return nullptr;
@@ -270,6 +760,7 @@ inline CrossAlloc::MemoryNode *CrossAlloc::MemoryNode::merge_neighbors(MemoryNod
 
         node->size += next->size;
         node->level = size2level_classify(node->size);
+        node->committed = node->committed || next->committed;
 
         node->origin_next = next->origin_next;
         if (next->origin_next != nullptr) {
@@ -283,6 +774,8 @@ inline CrossAlloc::MemoryNode *CrossAlloc::MemoryNode::merge_neighbors(MemoryNod
 }
 
 
+inline CrossAlloc::OriginChunk CrossAlloc::origin_chunks{};
+
 inline CrossAlloc::MemoryNode CrossAlloc::free_table[Hierachy::SIZE] = {
         MemoryNode{B8, true,},
         MemoryNode{B16, true,},
@@ -364,7 +857,7 @@ inline CrossAlloc::MemoryNode CrossAlloc::allocated_table[Hierachy::SIZE] = {
 };
 
 
-void CrossAlloc::print_table(bool free) {
+inline void CrossAlloc::print_table(bool free) {
     using namespace std::string_literals;
     std::string res{};
     static auto const free_label = AnsiColor::colorize<AnsiColor::GREEN>("[Free  ]");
@@ -373,6 +866,7 @@ void CrossAlloc::print_table(bool free) {
     std::stringstream ss{};
 
     MemoryNode *table = free ? free_table : allocated_table;
+    AllLocks guard{};
 
 //    for (auto &i: free_table) {
     for (int i = 0; i < Hierachy::SIZE; i++) {
@@ -405,12 +899,13 @@ void CrossAlloc::print_table(bool free) {
     std::cout << std::flush;
 }
 
-void CrossAlloc::print_origin_vec() {
+inline void CrossAlloc::print_origin_vec() {
     using namespace std::string_literals;
     std::string res{};
     auto label = AnsiColor::colorize<AnsiColor::YELLOW>("[Origin]") + " ";
     std::stringstream ss{};
-    for (auto &it: origin_vec) {
+    AllLocks guard{};
+    for_each_origin([&](OriginNode &it) {
         res += label;
 
         ss.str("");
@@ -424,13 +919,13 @@ void CrossAlloc::print_origin_vec() {
         ss.str("");
         ss << "size: " << it.size;
         res += AnsiColor::colorize<AnsiColor::CYAN>(ss.str()) + "\n";
-    }
+    });
 
     std::cout << res;
     std::cout << std::flush;
 }
 
-void CrossAlloc::visualize() {
+inline void CrossAlloc::visualize() {
     std::cout << "=========================VISUALIZE===============================\n";
     print_origin_vec();
     print_table(true); // free list
@@ -438,5 +933,48 @@ void CrossAlloc::visualize() {
     std::cout << "============================END==================================\n";
 }
 
+inline std::vector<CrossAlloc::OriginReport> CrossAlloc::fragmentation_report() {
+    std::vector<OriginReport> res{};
+    AllLocks guard{};
+    for_each_origin([&](OriginNode &origin) {
+        OriginReport report{origin.mem, origin.size, origin.used, 0, 0, 0};
+        for (auto curr = origin.head; curr != nullptr; curr = curr->origin_next) {
+            if (curr->is_free) {
+                report.free += curr->size;
+                report.free_nodes++;
+                report.largest_free = std::max(report.largest_free, curr->size);
+            }
+        }
+        res.push_back(report);
+    });
+    return res;
+}
+
+inline void CrossAlloc::print_fragmentation() {
+    std::string res{};
+    auto label = AnsiColor::colorize<AnsiColor::YELLOW>("[Frag  ]") + " ";
+    std::stringstream ss{};
+    for (auto &it: fragmentation_report()) {
+        res += label;
+
+        ss.str("");
+        ss << "[" << (void *) it.mem << ", " << (void *) (it.mem + it.size) << "]";
+        res += AnsiColor::colorize<AnsiColor::BLUE>(ss.str()) + " ";
+
+        ss.str("");
+        ss << "used: " << it.used << "/" << it.size;
+        res += AnsiColor::colorize<AnsiColor::MAGENTA>(ss.str()) + " ";
+
+        // share of free bytes outside the largest free node
+        ss.str("");
+        ss << "free nodes: " << it.free_nodes << ", largest free: " << it.largest_free
+           << ", fragmentation: " << (it.free == 0 ? 0.0 : 1.0 - (double) it.largest_free / (double) it.free);
+        res += AnsiColor::colorize<AnsiColor::CYAN>(ss.str()) + "\n";
+    }
+
+    std::cout << res;
+    std::cout << std::flush;
+}
+
 
 #endif //ALLOCATOR_CROSS_ALLOC_H
@@ -0,0 +1,133 @@
+//
+// Created by PinkLure on 9/18/2022.
+//
+
+#ifndef ALLOCATOR_FORK_SAFETY_H
+#define ALLOCATOR_FORK_SAFETY_H
+
+#include <mutex>
+
+#if __has_include(<pthread.h>)
+
+#include <pthread.h>
+
+#endif
+
+// every component holding locks embeds a ForkHook and attaches it to ForkRegistry
+// around fork() the registry runs, without allocating or printing:
+//   prepare : higher layers first, each takes all of its locks so its state is quiescent
+//   parent  : lower layers first, each releases its locks
+//   child   : lower layers first, each releases its locks and takes over what dead threads left behind
+// the child inherits the heap exactly as it was when every lock was held, so the tables need no rebuild
+struct ForkHook {
+    // components built on top of others use a higher layer
+    int layer{};
+    void *self{};
+
+    void (*prepare)(void *){};
+
+    void (*parent)(void *){};
+
+    void (*child)(void *){};
+
+    ForkHook *prev{};
+    ForkHook *next{};
+};
+
+// CrossAlloc
+constexpr int FORK_LAYER_ENGINE = 0;
+// BasicHeap, ObjectPool and their thread caches
+constexpr int FORK_LAYER_CACHE = 1;
+
+class ForkRegistry {
+public:
+    ForkRegistry() = delete;
+
+    ~ForkRegistry() = delete;
+
+    void operator=(ForkRegistry const &) = delete;
+
+    static void attach(ForkHook *hook);
+
+    static void detach(ForkHook *hook);
+
+private:
+    inline static std::mutex lock{};
+    inline static ForkHook head{};
+    inline static bool installed{};
+
+    static void on_prepare();
+
+    static void on_parent();
+
+    static void on_child();
+};
+
+
+// ============================ implementation begin =========================================
+
+
+inline void ForkRegistry::attach(ForkHook *hook) {
+    std::lock_guard guard{lock};
+#if __has_include(<pthread.h>)
+    if (!installed) {
+        pthread_atfork(on_prepare, on_parent, on_child);
+        installed = true;
+    }
+#endif
+    hook->prev = &head;
+    hook->next = head.next;
+    if (head.next != nullptr) {
+        head.next->prev = hook;
+    }
+    head.next = hook;
+}
+
+inline void ForkRegistry::detach(ForkHook *hook) {
+    std::lock_guard guard{lock};
+    if (hook->prev != nullptr) {
+        hook->prev->next = hook->next;
+    }
+    if (hook->next != nullptr) {
+        hook->next->prev = hook->prev;
+    }
+    hook->prev = nullptr;
+    hook->next = nullptr;
+}
+
+inline void ForkRegistry::on_prepare() {
+    // held across fork, so no hook attaches or detaches in between
+    lock.lock();
+    for (int layer = FORK_LAYER_CACHE; layer >= FORK_LAYER_ENGINE; layer--) {
+        for (auto curr = head.next; curr != nullptr; curr = curr->next) {
+            if (curr->layer == layer) {
+                curr->prepare(curr->self);
+            }
+        }
+    }
+}
+
+inline void ForkRegistry::on_parent() {
+    for (int layer = FORK_LAYER_ENGINE; layer <= FORK_LAYER_CACHE; layer++) {
+        for (auto curr = head.next; curr != nullptr; curr = curr->next) {
+            if (curr->layer == layer) {
+                curr->parent(curr->self);
+            }
+        }
+    }
+    lock.unlock();
+}
+
+inline void ForkRegistry::on_child() {
+    // the forking thread took every lock in prepare and is the only thread left, so it may release them
+    for (int layer = FORK_LAYER_ENGINE; layer <= FORK_LAYER_CACHE; layer++) {
+        for (auto curr = head.next; curr != nullptr; curr = curr->next) {
+            if (curr->layer == layer) {
+                curr->child(curr->self);
+            }
+        }
+    }
+    lock.unlock();
+}
+
+#endif //ALLOCATOR_FORK_SAFETY_H
@@ -0,0 +1,71 @@
+//
+// Created by PinkLure on 9/6/2022.
+//
+
+#ifndef ALLOCATOR_MEMORY_HIERACHY_H
+#define ALLOCATOR_MEMORY_HIERACHY_H
+
+#include <bit>
+#include <cassert>
+#include <cstddef>
+#include <limits>
+#include <string_view>
+
+constexpr auto PAGE_SIZE = 4096UL;
+constexpr auto MIN_UNIT = 8UL; // 8 * n
+
+template<typename UINT>
+requires (std::numeric_limits<UINT>::is_integer && !std::numeric_limits<UINT>::is_signed)
+constexpr UINT ceil_divide(UINT x, UINT y) {
+    return x == 0 ? 0 : 1 + (x - 1) / y;
+}
+
+// power-of-two size classes, level n manages blocks of (MIN_UNIT << n) bytes
+enum Hierachy {
+    B8, B16, B32, B64, B128, B256, B512,
+    K1, K2, K4, K8, K16, K32, K64, K128, K256, K512,
+    M1, M2, M4, M8, M16, M32, M64, M128, M256, M512,
+    G1, G2, G4, G8, G16, G32, G64, G128, G256, G512,
+    SIZE,
+    UNDEF,
+};
+
+constexpr std::size_t level2size(Hierachy level) {
+    assert(level < Hierachy::SIZE);
+    return MIN_UNIT << level;
+}
+
+// smallest level whose blocks can hold $size
+constexpr Hierachy size2level_allocate(std::size_t size) {
+    assert(size != 0 && size <= level2size(Hierachy::G512));
+    if (size <= MIN_UNIT) {
+        return Hierachy::B8;
+    }
+    return static_cast<Hierachy>(std::bit_width(size - 1) - std::bit_width(MIN_UNIT - 1));
+}
+
+// largest level whose block size does not exceed $size
+constexpr Hierachy size2level_classify(std::size_t size) {
+    assert(size >= MIN_UNIT);
+    auto level = std::bit_width(size) - std::bit_width(MIN_UNIT);
+    return level < Hierachy::SIZE ? static_cast<Hierachy>(level) : Hierachy::G512;
+}
+
+constexpr std::string_view level2str(Hierachy level) {
+    constexpr std::string_view names[] = {
+            "B8", "B16", "B32", "B64", "B128", "B256", "B512",
+            "K1", "K2", "K4", "K8", "K16", "K32", "K64", "K128", "K256", "K512",
+            "M1", "M2", "M4", "M8", "M16", "M32", "M64", "M128", "M256", "M512",
+            "G1", "G2", "G4", "G8", "G16", "G32", "G64", "G128", "G256", "G512",
+    };
+    return level < Hierachy::SIZE ? names[level] : "UNDEF";
+}
+
+static_assert(level2size(Hierachy::B8) == 8);
+static_assert(level2size(Hierachy::K4) == PAGE_SIZE);
+static_assert(level2size(Hierachy::G512) == 512UL << 30);
+static_assert(size2level_allocate(4096) == Hierachy::K4);
+static_assert(size2level_allocate(4097) == Hierachy::K8);
+static_assert(size2level_classify(8191) == Hierachy::K4);
+
+#endif //ALLOCATOR_MEMORY_HIERACHY_H
@@ -5,21 +5,12 @@
 #ifndef ALLOCATOR_MINI_ALLOC_H
 #define ALLOCATOR_MINI_ALLOC_H
 
+#include "memory_hierachy.h"
 #include "3rd/ansi-color.h"
 #include <cassert>
 #include <sstream>
 #include <iostream>
 #include <cstddef>
-#include <limits>
-
-constexpr auto PAGE_SIZE = 4096UL;
-constexpr auto MIN_UNIT = 8UL; // 8 * n
-
-template<typename UINT>
-requires (std::numeric_limits<UINT>::is_integer && !std::numeric_limits<UINT>::is_signed)
-UINT ceil_divide(UINT x, UINT y) {
-    return x == 0 ? 0 : 1 + (x - 1) / y;
-}
 
 struct PieceNode {
     char *data;
@@ -30,14 +21,27 @@ struct PieceNode {
 
 class MiniAlloc {
     PieceNode dummy;
+    // every region taken by memory_alloc, chained by next_free, released by the destructor
+    PieceNode *regions{};
 
     void memory_alloc(std::size_t init_size) {
         assert(init_size > 0);
         auto ceil_size = ceil_divide(init_size, PAGE_SIZE) * PAGE_SIZE;
-        auto node = new PieceNode{new char[ceil_size], ceil_size, dummy.next_free, dummy.next_allocated};
+        auto data = new char[ceil_size];
+        regions = new PieceNode{data, ceil_size, regions, nullptr};
+        // the new free node goes right after dummy, whose allocated nodes stay with dummy
+        auto node = new PieceNode{data, ceil_size, dummy.next_free, nullptr};
         dummy.next_free = node;
     }
 
+    // last node of the allocated chain hanging off $node, $node itself if the chain is empty
+    static PieceNode *allocated_tail(PieceNode *node) {
+        while (node->next_allocated != nullptr) {
+            node = node->next_allocated;
+        }
+        return node;
+    }
+
     PieceNode *pick_fit_node(std::size_t size) {
         assert(size > 0);
         auto ceil_size = ceil_divide(size, MIN_UNIT) * MIN_UNIT;
@@ -56,7 +60,8 @@ class MiniAlloc {
             if (curr->size == ceil_size) {
                 prev->next_free = curr->next_free;
                 curr->next_free = nullptr;
-                prev->next_allocated = curr;
+                // curr and its allocated nodes now follow the allocated nodes of prev
+                allocated_tail(prev)->next_allocated = curr;
                 return curr;
             } else {
                 auto node = new PieceNode{curr->data + curr->size - ceil_size, ceil_size, nullptr,
@@ -84,17 +89,19 @@ class MiniAlloc {
         }
     }
 
-    static void try_merge(PieceNode *node1, PieceNode *node2) {
+    // return true if node2 was merged into node1 and deleted
+    static bool try_merge(PieceNode *node1, PieceNode *node2) {
         if (node1 == nullptr || node2 == nullptr) {
-            return;
+            return false;
         }
         if (node1->data + node1->size == node2->data) {
-            // no need to check if node1->next_allocated == nullptr
             node1->next_free = node2->next_free;
-            node1->next_allocated = node2->next_allocated;
+            allocated_tail(node1)->next_allocated = node2->next_allocated;
             node1->size += node2->size;
             delete node2;
+            return true;
         }
+        return false;
     }
 
 
@@ -106,8 +113,8 @@ class MiniAlloc {
                 if (res != nullptr) {
                     res->next_free = curr->next_free;
                     curr->next_free = res;
-                    try_merge(curr, res);
-                    try_merge(res, res->next_free);
+                    auto merged = try_merge(curr, res) ? curr : res;
+                    try_merge(merged, merged->next_free);
                     return;
                 }
             }
@@ -177,6 +184,33 @@ public:
         }
     }
 
+    ~MiniAlloc() {
+        auto free_node = &dummy;
+        while (free_node != nullptr) {
+            auto node = free_node->next_allocated;
+            while (node != nullptr) {
+                auto next = node->next_allocated;
+                delete node;
+                node = next;
+            }
+            auto next_free = free_node->next_free;
+            if (free_node != &dummy) {
+                delete free_node;
+            }
+            free_node = next_free;
+        }
+        while (regions != nullptr) {
+            auto next = regions->next_free;
+            delete[] regions->data;
+            delete regions;
+            regions = next;
+        }
+    }
+
+    MiniAlloc(MiniAlloc const &) = delete;
+
+    void operator=(MiniAlloc const &) = delete;
+
     [[nodiscard]] void *alloc(std::size_t sz) {
         if (sz == 0) {
             return nullptr;
@@ -0,0 +1,237 @@
+//
+// Created by PinkLure on 9/12/2022.
+//
+
+#ifndef ALLOCATOR_OBJECT_POOL_H
+#define ALLOCATOR_OBJECT_POOL_H
+
+#include "basic_heap.h"
+#include "cross_alloc.h"
+#include "thread_cache.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// fixed-size pool for one hot type
+// slabs are taken from CrossAlloc and cut into slots of exactly sizeof(T) with alignof(T),
+// free slots form an intrusive list, so create/destroy carry no header and cost O(1)
+// Lock guards the pool, CACHE > 0 keeps up to CACHE free slots per thread in front of it, see thread_cache.h
+template<typename T, typename Lock = NullLock, std::size_t CACHE = 0>
+class ObjectPool {
+    union Slot {
+        Slot *next;
+        alignas(T) std::byte storage[sizeof(T)];
+    };
+
+    // header at the start of every slab, slabs are chained for release
+    struct Slab {
+        Slab *next;
+    };
+
+    // CrossAlloc blocks are MIN_UNIT aligned, slots aligned stricter than that need padding after the header
+    static constexpr std::size_t SLAB_PADDING = alignof(Slot) > MIN_UNIT ? alignof(Slot) - MIN_UNIT : 0;
+    static constexpr std::size_t SLAB_OVERHEAD = sizeof(Slab) + SLAB_PADDING;
+
+    // a slab fills one CrossAlloc level exactly, counting CrossAlloc's MIN_UNIT size header:
+    // a page, or the smallest level holding 8 slots for large T
+    static constexpr std::size_t SLAB_LEVEL_SIZE =
+            std::max(PAGE_SIZE, level2size(size2level_allocate(MIN_UNIT + SLAB_OVERHEAD + 8 * sizeof(Slot))));
+    static constexpr std::size_t SLAB_SLOTS = (SLAB_LEVEL_SIZE - MIN_UNIT - SLAB_OVERHEAD) / sizeof(Slot);
+    static constexpr std::size_t SLAB_BYTES = SLAB_OVERHEAD + SLAB_SLOTS * sizeof(Slot);
+    static_assert(MIN_UNIT + SLAB_BYTES <= SLAB_LEVEL_SIZE);
+
+    using Registry = ThreadCacheRegistry<ObjectPool, 1>;
+    friend Registry;
+
+    Slot *free_list{};
+    Slab *slabs{};
+    [[no_unique_address]] Lock lock{};
+    Registry caches{};
+
+    // caller holds lock
+    void release_cached(CacheLink *list) {
+        while (list != nullptr) {
+            auto next = list->next;
+            push_shared((Slot *) list);
+            list = next;
+        }
+    }
+
+    // a pool without locks has nothing to quiesce across fork
+    static constexpr bool FORK_HOOKED = !std::is_same_v<Lock, NullLock>;
+    ForkHook fork_hook{
+            FORK_LAYER_CACHE, this,
+            [](void *self) { ((ObjectPool *) self)->lock.lock(); },
+            [](void *self) { ((ObjectPool *) self)->lock.unlock(); },
+            [](void *self) {
+                auto pool = (ObjectPool *) self;
+                pool->caches.reclaim_dead();
+                pool->lock.unlock();
+            },
+    };
+
+    // cut a new slab into slots, lowest address is handed out first
+    void grow() {
+        auto raw = (std::byte *) CrossAlloc::alloc(SLAB_BYTES);
+        if (raw == nullptr) {
+            throw std::bad_alloc{};
+        }
+        auto slab = (Slab *) raw;
+        slab->next = slabs;
+        slabs = slab;
+
+        auto begin = (std::uintptr_t) (raw + sizeof(Slab));
+        auto slots = (Slot *) (ceil_divide(begin, (std::uintptr_t) alignof(Slot)) * alignof(Slot));
+        for (auto i = SLAB_SLOTS; i > 0; i--) {
+            push_shared(&slots[i - 1]);
+        }
+    }
+
+    void push_shared(Slot *slot) {
+        slot->next = free_list;
+        free_list = slot;
+    }
+
+    // caller holds lock
+    Slot *pop_shared() {
+        if (caches.has_orphans()) {
+            caches.release_orphans(*this);
+        }
+        if (free_list == nullptr) {
+            grow();
+        }
+        auto slot = free_list;
+        free_list = slot->next;
+        return slot;
+    }
+
+    Slot *pop() {
+        if constexpr (CACHE > 0) {
+            auto &cache = Registry::local();
+            if (cache.bound() == this) {
+                if (auto slot = cache.pop(0); slot != nullptr) {
+                    return (Slot *) slot;
+                }
+            }
+
+            // refill half of the cache under one lock
+            std::lock_guard guard{lock};
+            auto slot = pop_shared();
+            if (cache.bound() == nullptr) {
+                caches.claim(*this, cache);
+            }
+            if (cache.bound() == this) {
+                while (cache.count(0) < CACHE / 2 && free_list != nullptr) {
+                    cache.push(0, pop_shared());
+                }
+            }
+            return slot;
+        } else {
+            std::lock_guard guard{lock};
+            return pop_shared();
+        }
+    }
+
+    void push(Slot *slot) {
+        if constexpr (CACHE > 0) {
+            auto &cache = Registry::local();
+            if (cache.bound() == nullptr) {
+                std::lock_guard guard{lock};
+                caches.claim(*this, cache);
+            }
+            if (cache.bound() == this && cache.count(0) < CACHE) {
+                cache.push(0, slot);
+                return;
+            }
+        }
+        std::lock_guard guard{lock};
+        push_shared(slot);
+    }
+
+public:
+    struct Deleter {
+        ObjectPool *pool;
+
+        void operator()(T *obj) const {
+            pool->destroy(obj);
+        }
+    };
+
+    using Handle = std::unique_ptr<T, Deleter>;
+
+    ObjectPool() {
+        if constexpr (FORK_HOOKED) {
+            ForkRegistry::attach(&fork_hook);
+        }
+    }
+
+    ObjectPool(ObjectPool const &) = delete;
+
+    void operator=(ObjectPool const &) = delete;
+
+    // every object must be destroyed before the pool, slabs go back to CrossAlloc
+    // thread caches are detached first, their slots live in the slabs
+    ~ObjectPool() {
+        if constexpr (FORK_HOOKED) {
+            ForkRegistry::detach(&fork_hook);
+        }
+        {
+            std::lock_guard guard{lock};
+            caches.release_all(*this);
+        }
+        while (slabs != nullptr) {
+            auto slab = slabs;
+            slabs = slab->next;
+            CrossAlloc::dealloc(slab);
+        }
+    }
+
+    // one pool per type and configuration for the whole process
+    static ObjectPool &global() {
+        static ObjectPool pool{};
+        return pool;
+    }
+
+    template<typename... Args>
+    [[nodiscard]] T *create(Args &&... args) {
+        auto slot = pop();
+        try {
+            return new(slot->storage) T(std::forward<Args>(args)...);
+        } catch (...) {
+            push(slot);
+            throw;
+        }
+    }
+
+    void destroy(T *obj) {
+        if (obj == nullptr) {
+            return;
+        }
+        obj->~T();
+        push((Slot *) obj);
+    }
+
+    template<typename... Args>
+    [[nodiscard]] Handle make(Args &&... args) {
+        return Handle{create(std::forward<Args>(args)...), Deleter{this}};
+    }
+};
+
+// process-wide pool behind make_pooled, safe to share between threads
+template<typename T>
+using SharedPool = ObjectPool<T, std::mutex, 32>;
+
+template<typename T>
+using Pooled = typename SharedPool<T>::Handle;
+
+template<typename T, typename... Args>
+Pooled<T> make_pooled(Args &&... args) {
+    return SharedPool<T>::global().make(std::forward<Args>(args)...);
+}
+
+#endif //ALLOCATOR_OBJECT_POOL_H
@@ -0,0 +1,61 @@
+//
+// Created by PinkLure on 9/14/2022.
+//
+
+#ifndef ALLOCATOR_PAGE_SOURCE_H
+#define ALLOCATOR_PAGE_SOURCE_H
+
+#include <cstddef>
+
+#if __has_include(<sys/mman.h>)
+
+#include <sys/mman.h>
+
+#endif
+
+// a page source hands out raw regions:
+//   static std::byte *map(std::size_t size);                 nullptr on failure
+//   static void unmap(std::byte *mem, std::size_t size);
+//   static bool decommit(std::byte *mem, std::size_t size);  give pages back but keep the range, false if unsupported
+
+struct HeapPageSource {
+    static std::byte *map(std::size_t size) {
+        return new std::byte[size];
+    }
+
+    static void unmap(std::byte *mem, std::size_t) {
+        delete[] mem;
+    }
+
+    static bool decommit(std::byte *, std::size_t) {
+        return false;
+    }
+};
+
+#if __has_include(<sys/mman.h>)
+
+struct MmapPageSource {
+    static std::byte *map(std::size_t size) {
+        auto mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        return mem == MAP_FAILED ? nullptr : (std::byte *) mem;
+    }
+
+    static void unmap(std::byte *mem, std::size_t size) {
+        munmap(mem, size);
+    }
+
+    // private anonymous pages read back as zero after this, the range stays usable
+    static bool decommit(std::byte *mem, std::size_t size) {
+        return madvise(mem, size, MADV_DONTNEED) == 0;
+    }
+};
+
+using SystemPageSource = MmapPageSource;
+
+#else
+
+using SystemPageSource = HeapPageSource;
+
+#endif
+
+#endif //ALLOCATOR_PAGE_SOURCE_H
@@ -0,0 +1,489 @@
+//
+// Created by PinkLure on 9/20/2022.
+//
+
+#ifndef ALLOCATOR_PERSISTENT_ALLOC_H
+#define ALLOCATOR_PERSISTENT_ALLOC_H
+
+#include "memory_hierachy.h"
+#include "fork_safety.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <system_error>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// CrossAlloc's segregated free lists kept inside a shared file mapping
+// the file holds a superblock followed by one origin region, every link is an offset from the mapping base,
+// so a restarted process maps the file anywhere and finds the heap as it was left
+// store offsets (offset_of / at) instead of pointers inside the heap, and hang the entry object off root()
+// the capacity is fixed when the file is created
+// one process at a time owns the file: the open takes an exclusive flock,
+// and a forked child gets a detached instance that leaves the heap to its parent
+class PersistentAlloc {
+public:
+    // open $path, creating a heap of $size bytes if the file is empty
+    // throw if another process has the heap open
+    // a heap left dirty by a crashed process is checked, and its free lists rebuilt if the check fails
+    // $base_hint asks for a fixed base, the heap works at any base
+    PersistentAlloc(char const *path, std::size_t size, void *base_hint = nullptr);
+
+    // mark the heap clean and flush it to the file, a detached instance only unmaps
+    ~PersistentAlloc();
+
+    PersistentAlloc(PersistentAlloc const &) = delete;
+
+    void operator=(PersistentAlloc const &) = delete;
+
+    // nullptr once detached
+    void *alloc(std::size_t size);
+
+    // $mem must come from alloc of this heap, false once detached
+    bool dealloc(void *mem);
+
+    std::uint64_t offset_of(void const *mem) const;
+
+    void *at(std::uint64_t offset) const;
+
+    // entry object of the heap, nullptr if never set
+    void *root() const;
+
+    void set_root(void *mem);
+
+    // flush the mapping to the file
+    void sync();
+
+    // walk the region and every free list, return false on any inconsistency
+    bool check();
+
+    // rebuild the free lists from the block walk, merging free neighbors
+    // return false if the block walk itself is broken
+    bool recover();
+
+    std::byte *base() const {
+        return mem;
+    }
+
+private:
+    static constexpr std::uint64_t MAGIC = 0x50494e4b4c555245; // "PINKLURE"
+    static constexpr std::uint64_t VERSION = 1;
+
+    struct Superblock {
+        std::uint64_t magic;
+        std::uint64_t version;
+        std::uint64_t size;
+        std::uint64_t root;
+        // set while a process has the heap mapped
+        std::uint64_t dirty;
+        std::uint64_t free_heads[Hierachy::SIZE];
+    };
+
+    // boundary tag at the start of every block, $size covers the header, the low bit marks a free block
+    struct Block {
+        std::uint64_t size_and_free;
+        // size of the block right before in address order, 0 for the first block
+        std::uint64_t prev_size;
+
+        std::uint64_t size() const {
+            return size_and_free & ~std::uint64_t{1};
+        }
+
+        bool is_free() const {
+            return (size_and_free & 1) != 0;
+        }
+
+        void set(std::uint64_t size, bool free) {
+            size_and_free = size | (free ? 1 : 0);
+        }
+    };
+
+    // free blocks keep their list links right after the header
+    struct FreeLinks {
+        std::uint64_t list_prev;
+        std::uint64_t list_next;
+    };
+
+    static constexpr std::uint64_t HEADER = sizeof(Block);
+    static constexpr std::uint64_t MIN_BLOCK = sizeof(Block) + sizeof(FreeLinks);
+    static constexpr std::uint64_t REGION_BEGIN = ceil_divide<std::uint64_t>(sizeof(Superblock), MIN_UNIT) * MIN_UNIT;
+
+    std::byte *mem{};
+    std::size_t mapped_size{};
+    int fd{-1};
+    std::mutex lock{};
+    // set in a forked child, the parent keeps writing the shared mapping, so the child never touches it again
+    bool detached{};
+
+    ForkHook fork_hook{
+            FORK_LAYER_ENGINE, this,
+            [](void *self) { ((PersistentAlloc *) self)->lock.lock(); },
+            [](void *self) { ((PersistentAlloc *) self)->lock.unlock(); },
+            [](void *self) {
+                // the child drops its copy of the descriptor, so the flock goes away when the parent closes
+                auto heap = (PersistentAlloc *) self;
+                heap->detached = true;
+                close(heap->fd);
+                heap->fd = -1;
+                heap->lock.unlock();
+            },
+    };
+
+private:
+    Superblock *super() const {
+        return (Superblock *) mem;
+    }
+
+    Block *block_at(std::uint64_t offset) const {
+        return (Block *) (mem + offset);
+    }
+
+    FreeLinks *links(std::uint64_t offset) const {
+        return (FreeLinks *) (mem + offset + HEADER);
+    }
+
+    // offset of the block after $offset, or the region end
+    std::uint64_t next_of(std::uint64_t offset) const {
+        return offset + block_at(offset)->size();
+    }
+
+    std::uint64_t region_end() const {
+        return super()->size;
+    }
+
+    void format();
+
+    void insert_free(std::uint64_t offset);
+
+    void detach_free(std::uint64_t offset);
+
+    // first free block can hold $need, or 0
+    std::uint64_t find_free(std::uint64_t need);
+
+    // the block after $offset learns its new neighbor size
+    void fix_next_prev_size(std::uint64_t offset);
+};
+
+
+// ============================ implementation begin =========================================
+
+
+inline PersistentAlloc::PersistentAlloc(char const *path, std::size_t size, void *base_hint) {
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        throw std::system_error{errno, std::generic_category(), path};
+    }
+    // held until close, exec'd children never inherit the descriptor and forked ones close it in the fork hook
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        auto error = errno;
+        close(fd);
+        throw std::system_error{error, std::generic_category(), path};
+    }
+
+    struct stat st{};
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        throw std::system_error{errno, std::generic_category(), path};
+    }
+
+    auto fresh = st.st_size == 0;
+    if (fresh) {
+        size = ceil_divide(size, PAGE_SIZE) * PAGE_SIZE;
+        if (size < REGION_BEGIN + MIN_BLOCK || ftruncate(fd, (off_t) size) != 0) {
+            close(fd);
+            throw std::system_error{errno == 0 ? EINVAL : errno, std::generic_category(), path};
+        }
+    } else {
+        size = (std::size_t) st.st_size;
+    }
+
+    // a mapping pins the open file description it was made from, and a forked child inherits the mapping,
+    // so map through a second description that holds no lock, the child then keeps the view but not the flock
+    auto map_fd = open(path, O_RDWR | O_CLOEXEC);
+    struct stat map_st{};
+    if (map_fd < 0 || fstat(map_fd, &map_st) != 0 || map_st.st_dev != st.st_dev || map_st.st_ino != st.st_ino) {
+        auto error = map_fd < 0 ? errno : EBUSY;
+        if (map_fd >= 0) {
+            close(map_fd);
+        }
+        close(fd);
+        throw std::system_error{error, std::generic_category(), path};
+    }
+    auto res = mmap(base_hint, size, PROT_READ | PROT_WRITE, MAP_SHARED, map_fd, 0);
+    auto error = errno;
+    close(map_fd);
+    if (res == MAP_FAILED) {
+        close(fd);
+        throw std::system_error{error, std::generic_category(), path};
+    }
+    mem = (std::byte *) res;
+    mapped_size = size;
+
+    if (fresh) {
+        format();
+    } else if (super()->magic != MAGIC || super()->version != VERSION || super()->size != size) {
+        munmap(mem, mapped_size);
+        close(fd);
+        throw std::runtime_error{"not a persistent heap file"};
+    } else if (super()->dirty != 0 && !check() && !recover()) {
+        munmap(mem, mapped_size);
+        close(fd);
+        throw std::runtime_error{"persistent heap is corrupted beyond recovery"};
+    }
+
+    super()->dirty = 1;
+    ForkRegistry::attach(&fork_hook);
+}
+
+inline PersistentAlloc::~PersistentAlloc() {
+    ForkRegistry::detach(&fork_hook);
+    if (!detached) {
+        super()->dirty = 0;
+        sync();
+    }
+    munmap(mem, mapped_size);
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+inline void *PersistentAlloc::alloc(std::size_t size) {
+    if (size == 0 || size > mapped_size) {
+        return nullptr;
+    }
+    auto need = std::max(ceil_divide<std::uint64_t>(size, MIN_UNIT) * MIN_UNIT + HEADER, MIN_BLOCK);
+
+    std::lock_guard guard{lock};
+    if (detached) {
+        return nullptr;
+    }
+    auto offset = find_free(need);
+    if (offset == 0) {
+        return nullptr;
+    }
+
+    detach_free(offset);
+    auto block = block_at(offset);
+    if (block->size() - need >= MIN_BLOCK) {
+        // like CrossAlloc, keep the head free and hand out the tail
+        auto rest = block->size() - need;
+        block->set(rest, true);
+        insert_free(offset);
+
+        offset += rest;
+        block = block_at(offset);
+        block->prev_size = rest;
+        block->set(need, false);
+        fix_next_prev_size(offset);
+    } else {
+        block->set(block->size(), false);
+    }
+    return mem + offset + HEADER;
+}
+
+inline bool PersistentAlloc::dealloc(void *ptr) {
+    if (ptr == nullptr) {
+        return false;
+    }
+    auto offset = offset_of(ptr) - HEADER;
+    if (offset < REGION_BEGIN || offset >= region_end()) {
+        return false;
+    }
+
+    std::lock_guard guard{lock};
+    auto block = block_at(offset);
+    if (detached || block->is_free()) {
+        return false;
+    }
+    block->set(block->size(), true);
+
+    auto next = next_of(offset);
+    if (next < region_end() && block_at(next)->is_free()) {
+        detach_free(next);
+        block->set(block->size() + block_at(next)->size(), true);
+    }
+    if (block->prev_size != 0) {
+        auto prev = offset - block->prev_size;
+        if (block_at(prev)->is_free()) {
+            detach_free(prev);
+            block_at(prev)->set(block_at(prev)->size() + block->size(), true);
+            offset = prev;
+        }
+    }
+    fix_next_prev_size(offset);
+    insert_free(offset);
+    return true;
+}
+
+inline std::uint64_t PersistentAlloc::offset_of(void const *ptr) const {
+    return (std::uint64_t) ((std::byte const *) ptr - mem);
+}
+
+inline void *PersistentAlloc::at(std::uint64_t offset) const {
+    return offset == 0 ? nullptr : mem + offset;
+}
+
+inline void *PersistentAlloc::root() const {
+    return at(super()->root);
+}
+
+inline void PersistentAlloc::set_root(void *ptr) {
+    std::lock_guard guard{lock};
+    if (detached) {
+        return;
+    }
+    super()->root = ptr == nullptr ? 0 : offset_of(ptr);
+}
+
+inline void PersistentAlloc::sync() {
+    if (detached) {
+        return;
+    }
+    msync(mem, mapped_size, MS_SYNC);
+}
+
+inline bool PersistentAlloc::check() {
+    std::lock_guard guard{lock};
+    if (detached) {
+        return false;
+    }
+
+    // address walk: sizes tile the region, boundary tags agree, free neighbors are merged
+    // free blocks are collected in address order
+    std::vector<std::uint64_t> walked_free{};
+    std::uint64_t prev_size = 0;
+    bool prev_free = false;
+    auto offset = REGION_BEGIN;
+    while (offset < region_end()) {
+        auto block = block_at(offset);
+        if (block->size() < MIN_BLOCK || block->size() % MIN_UNIT != 0 || block->size() > region_end() - offset) {
+            return false;
+        }
+        if (block->prev_size != prev_size || (prev_free && block->is_free())) {
+            return false;
+        }
+        if (block->is_free()) {
+            walked_free.push_back(offset);
+        }
+        prev_size = block->size();
+        prev_free = block->is_free();
+        offset = next_of(offset);
+    }
+
+    // list walk: every entry is a free block found by the address walk, listed under its level
+    // with consistent back links, and as many entries as free blocks means each is listed once
+    std::size_t listed_free = 0;
+    for (int i = 0; i < Hierachy::SIZE; i++) {
+        std::uint64_t prev = 0;
+        for (auto curr = super()->free_heads[i]; curr != 0; curr = links(curr)->list_next) {
+            if (!std::binary_search(walked_free.begin(), walked_free.end(), curr)) {
+                return false;
+            }
+            if (size2level_classify(block_at(curr)->size()) != i || links(curr)->list_prev != prev ||
+                ++listed_free > walked_free.size()) {
+                return false;
+            }
+            prev = curr;
+        }
+    }
+    return listed_free == walked_free.size();
+}
+
+inline bool PersistentAlloc::recover() {
+    std::lock_guard guard{lock};
+    if (detached) {
+        return false;
+    }
+    std::memset(super()->free_heads, 0, sizeof(super()->free_heads));
+
+    std::uint64_t prev = 0;
+    auto offset = REGION_BEGIN;
+    while (offset < region_end()) {
+        auto block = block_at(offset);
+        if (block->size() < MIN_BLOCK || block->size() % MIN_UNIT != 0 || block->size() > region_end() - offset) {
+            return false;
+        }
+        block->prev_size = prev == 0 ? 0 : block_at(prev)->size();
+
+        if (block->is_free() && prev != 0 && block_at(prev)->is_free()) {
+            // absorb into the free block before, which is already listed
+            detach_free(prev);
+            block_at(prev)->set(block_at(prev)->size() + block->size(), true);
+            insert_free(prev);
+            offset = next_of(prev);
+            continue;
+        }
+        if (block->is_free()) {
+            insert_free(offset);
+        }
+        prev = offset;
+        offset = next_of(offset);
+    }
+    return true;
+}
+
+inline void PersistentAlloc::format() {
+    auto sb = super();
+    sb->magic = MAGIC;
+    sb->version = VERSION;
+    sb->size = mapped_size;
+    sb->root = 0;
+    sb->dirty = 0;
+    std::memset(sb->free_heads, 0, sizeof(sb->free_heads));
+
+    auto block = block_at(REGION_BEGIN);
+    block->prev_size = 0;
+    block->set((mapped_size - REGION_BEGIN) / MIN_UNIT * MIN_UNIT, true);
+    insert_free(REGION_BEGIN);
+}
+
+inline void PersistentAlloc::insert_free(std::uint64_t offset) {
+    auto &head = super()->free_heads[size2level_classify(block_at(offset)->size())];
+    links(offset)->list_prev = 0;
+    links(offset)->list_next = head;
+    if (head != 0) {
+        links(head)->list_prev = offset;
+    }
+    head = offset;
+}
+
+inline void PersistentAlloc::detach_free(std::uint64_t offset) {
+    auto link = links(offset);
+    if (link->list_prev != 0) {
+        links(link->list_prev)->list_next = link->list_next;
+    } else {
+        super()->free_heads[size2level_classify(block_at(offset)->size())] = link->list_next;
+    }
+    if (link->list_next != 0) {
+        links(link->list_next)->list_prev = link->list_prev;
+    }
+    link->list_prev = 0;
+    link->list_next = 0;
+}
+
+inline std::uint64_t PersistentAlloc::find_free(std::uint64_t need) {
+    for (int i = size2level_allocate(need); i < Hierachy::SIZE; i++) {
+        if (super()->free_heads[i] != 0) {
+            return super()->free_heads[i];
+        }
+    }
+    return 0;
+}
+
+inline void PersistentAlloc::fix_next_prev_size(std::uint64_t offset) {
+    auto next = next_of(offset);
+    if (next < region_end()) {
+        block_at(next)->prev_size = block_at(offset)->size();
+    }
+}
+
+#endif //ALLOCATOR_PERSISTENT_ALLOC_H
@@ -0,0 +1,104 @@
+//
+// Created by PinkLure on 9/10/2022.
+//
+
+#include "../basic_heap.h"
+
+#include <atomic>
+#include <cstring>
+#include <random>
+#include <thread>
+#include <vector>
+
+static std::size_t used_bytes() {
+    std::size_t used = 0;
+    for (auto &it: CrossAlloc::fragmentation_report()) {
+        used += it.used;
+    }
+    return used;
+}
+
+int main() {
+    TinyHeap tiny{};
+    auto a = tiny.alloc(331);
+    auto b = tiny.alloc(124);
+    tiny.dealloc(a, 331);
+    auto c = tiny.alloc(70000);
+    tiny.dealloc(c, 70000);
+    tiny.dealloc(b, 124);
+
+    // random churn, every region goes back when tiny is destroyed
+    std::mt19937 rng{42};
+    std::vector<std::pair<void *, std::size_t>> live{};
+    for (int i = 0; i < 2000; i++) {
+        if (live.empty() || rng() % 3 != 0) {
+            std::size_t size = 1 + rng() % (rng() % 8 == 0 ? 100000 : 3000);
+            auto mem = tiny.alloc(size);
+            assert(mem != nullptr);
+            std::memset(mem, 0xab, size);
+            live.emplace_back(mem, size);
+        } else {
+            auto k = rng() % live.size();
+            tiny.dealloc(live[k].first, live[k].second);
+            live[k] = live.back();
+            live.pop_back();
+        }
+    }
+    for (auto &[mem, size]: live) {
+        tiny.dealloc(mem, size);
+    }
+
+    // a heap may die before the threads that cached for it, main included
+    {
+        auto before = used_bytes();
+        std::atomic<bool> cached{};
+        std::atomic<bool> destroyed{};
+        std::thread late{};
+        {
+            ConcurrentHeap scoped{};
+            auto mem = scoped.alloc(40);
+            scoped.dealloc(mem, 40);
+            late = std::thread{[&] {
+                auto other = scoped.alloc(200);
+                scoped.dealloc(other, 200);
+                cached = true;
+                while (!destroyed) {
+                    std::this_thread::yield();
+                }
+            }};
+            while (!cached) {
+                std::this_thread::yield();
+            }
+        }
+        destroyed = true;
+        late.join();
+        assert(used_bytes() == before);
+    }
+
+    ConcurrentHeap heap{};
+    std::vector<std::thread> threads{};
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([&heap] {
+            for (int i = 0; i < 1000; i++) {
+                auto small = heap.alloc(48);
+                auto large = heap.alloc(100000);
+                assert(small != nullptr && large != nullptr);
+                heap.dealloc(large, 100000);
+                heap.dealloc(small, 48);
+            }
+        });
+    }
+    for (auto &thread: threads) {
+        thread.join();
+    }
+
+    auto &stats = heap.stats();
+    std::cout << "alloc: " << stats.alloc_count << ", dealloc: " << stats.dealloc_count
+              << ", live: " << stats.live_bytes << "\n";
+    assert(stats.alloc_count == stats.dealloc_count && stats.live_bytes == 0);
+    CrossAlloc::visualize();
+
+#ifdef ALLOCATOR_TRACE
+    AllocTrace::dump();
+#endif
+}
@@ -4,6 +4,9 @@
 
 #include "../cross_alloc.h"
 
+#include <cstring>
+#include <thread>
+
 
 int main() {
 #define Alloc(size) CrossAlloc::alloc(size);  CrossAlloc::visualize()
@@ -19,6 +22,81 @@ int main() {
     Dealloc(b);
     auto f = Alloc(7922);
     auto g = Alloc(9012);
+
+    void *nodes[600]{};
+    auto allocated = CrossAlloc::alloc_bulk(40, 600, nodes);
+    assert(allocated == 600);
+    for (auto node: nodes) {
+        assert(node != nullptr);
+    }
+    auto freed = CrossAlloc::free_bulk(nodes, 600);
+    assert(freed == 600);
+    CrossAlloc::visualize();
+
+    CrossAlloc::print_fragmentation();
+    auto returned = CrossAlloc::trim();
+    std::cout << "trimmed: " << returned << "\n";
+    assert(returned >= level2size(Hierachy::K32));
+    CrossAlloc::visualize();
+    CrossAlloc::print_fragmentation();
+    auto h = Alloc(30000);
+    Dealloc(h);
+
+    // large blocks of different levels do not share a lock
+    std::vector<std::thread> threads{};
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([t] {
+            for (int i = 0; i < 200; i++) {
+                auto large = CrossAlloc::alloc((64UL << 10) << (t + i % 3));
+                auto small = CrossAlloc::alloc(24 + t);
+                assert(large != nullptr && small != nullptr);
+                CrossAlloc::dealloc(small);
+                CrossAlloc::dealloc(large);
+            }
+        });
+    }
+    for (auto &thread: threads) {
+        thread.join();
+    }
+    CrossAlloc::trim();
+
+    // concurrent batches spanning several levels never free another thread's blocks
+    threads.clear();
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([t] {
+            constexpr std::size_t sizes[] = {24, 56, 120, 248, 504, 1016, 70000};
+            constexpr std::size_t batch = 12;
+            void *ptrs[std::size(sizes) * batch]{};
+            for (int i = 0; i < 1000; i++) {
+                std::size_t total = 0;
+                for (auto size: sizes) {
+                    total += CrossAlloc::alloc_bulk(size, batch, ptrs + total);
+                }
+                assert(total == std::size(ptrs));
+                for (std::size_t k = 0; k < total; k++) {
+                    std::memset(ptrs[k], t + 1, sizes[k / batch]);
+                }
+                if (t == 0 && i % 16 == 0) {
+                    CrossAlloc::trim();
+                }
+                for (std::size_t k = 0; k < total; k++) {
+                    auto mem = (unsigned char *) ptrs[k];
+                    assert(mem[0] == t + 1 && mem[sizes[k / batch] - 1] == t + 1);
+                }
+                auto freed = CrossAlloc::free_bulk(ptrs, total);
+                assert(freed == total);
+            }
+        });
+    }
+    for (auto &thread: threads) {
+        thread.join();
+    }
+    CrossAlloc::trim();
+    CrossAlloc::visualize();
+
+#ifdef ALLOCATOR_TRACE
+    AllocTrace::dump();
+#endif
 #undef Dealloc
 #undef Alloc
 }
\ No newline at end of file
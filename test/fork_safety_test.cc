@@ -0,0 +1,114 @@
+//
+// Created by PinkLure on 9/18/2022.
+//
+
+#include "../basic_heap.h"
+#include "../object_pool.h"
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+static std::size_t used_bytes() {
+    std::size_t used = 0;
+    for (auto &it: CrossAlloc::fragmentation_report()) {
+        used += it.used;
+    }
+    return used;
+}
+
+// fork, run $child in the child and return its exit status
+template<typename F>
+static int fork_and_wait(F child) {
+    auto pid = fork();
+    if (pid == 0) {
+        _exit(child());
+    }
+    int status{};
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+int main() {
+    // bytes CrossAlloc accounts for one 40 byte block of the heap
+    auto probe = CrossAlloc::alloc(HierachyClassMap<>::class_size(HierachyClassMap<>::classify(40)));
+    auto one_block = used_bytes();
+    CrossAlloc::dealloc(probe);
+
+    ConcurrentHeap heap{};
+
+    // parked workers keep freed blocks in their thread caches
+    std::atomic<bool> stop{};
+    std::atomic<int> parked{};
+    std::vector<std::thread> workers{};
+    for (int t = 0; t < 3; t++) {
+        workers.emplace_back([&] {
+            void *blocks[16]{};
+            for (auto &block: blocks) {
+                block = heap.alloc(40);
+            }
+            for (auto block: blocks) {
+                heap.dealloc(block, 40);
+            }
+            parked++;
+            while (!stop) {
+                std::this_thread::yield();
+            }
+        });
+    }
+    while (parked != 3) {
+        std::this_thread::yield();
+    }
+    assert(used_bytes() != 0);
+
+    // the child owns no thread cache, so everything cached by the dead workers must come back:
+    // the fork handler only relinks it, the first slow path of the child releases it
+    auto status = fork_and_wait([&] {
+        if (used_bytes() == 0) {
+            return 1;
+        }
+        auto mem = heap.alloc(40);
+        auto used = used_bytes();
+        heap.dealloc(mem, 40);
+        return used == one_block ? 0 : 2;
+    });
+    std::cout << "reclaim in child: " << status << "\n";
+    assert(status == 0);
+
+    // fork while other threads keep every lock busy
+    std::vector<std::thread> hammers{};
+    for (int t = 0; t < 3; t++) {
+        hammers.emplace_back([&, t] {
+            while (!stop) {
+                auto small = heap.alloc(24 + t);
+                auto large = CrossAlloc::alloc(100000 << t);
+                auto pooled = make_pooled<std::uint64_t>(t);
+                CrossAlloc::dealloc(large);
+                heap.dealloc(small, 24 + t);
+            }
+        });
+    }
+    for (int i = 0; i < 20; i++) {
+        status = fork_and_wait([&] {
+            auto small = heap.alloc(24);
+            auto large = CrossAlloc::alloc(1 << 20);
+            auto pooled = make_pooled<std::uint64_t>(i);
+            CrossAlloc::dealloc(large);
+            heap.dealloc(small, 24);
+            return 0;
+        });
+        assert(status == 0);
+    }
+    std::cout << "forks under load: ok\n";
+
+    stop = true;
+    for (auto &thread: hammers) {
+        thread.join();
+    }
+    for (auto &thread: workers) {
+        thread.join();
+    }
+}
@@ -0,0 +1,111 @@
+//
+// Created by PinkLure on 9/12/2022.
+//
+
+#include "../object_pool.h"
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+struct Connection {
+    int fd;
+    double weight;
+    char name[20];
+
+    Connection(int fd, double weight) : fd{fd}, weight{weight}, name{} {}
+};
+
+struct alignas(64) Line {
+    std::byte data[64];
+};
+
+struct Record {
+    std::byte data[32];
+};
+
+std::size_t mapped_bytes() {
+    std::size_t total = 0;
+    for (auto &report: CrossAlloc::fragmentation_report()) {
+        total += report.size;
+    }
+    return total;
+}
+
+int main() {
+    ObjectPool<Connection> pool{};
+    std::vector<Connection *> connections{};
+    for (int i = 0; i < 300; i++) {
+        connections.push_back(pool.create(i, i * 0.5));
+    }
+    // slots are packed at sizeof(T) within a slab
+    assert((std::byte *) connections[1] - (std::byte *) connections[0] == sizeof(Connection));
+    for (auto conn: connections) {
+        pool.destroy(conn);
+    }
+    // freed slots are reused lifo
+    auto reused = pool.make(7, 1.0);
+    assert(reused.get() == connections.back() && reused->fd == 7);
+
+    ObjectPool<Line> lines{};
+    auto line = lines.create();
+    assert((std::uintptr_t) line % alignof(Line) == 0);
+    lines.destroy(line);
+
+    // a slab and CrossAlloc's header fit one page, so slabs map no more than the objects they hold
+    {
+        ObjectPool<Record> records{};
+        std::vector<Record *> live{};
+        auto before = mapped_bytes();
+        for (int i = 0; i < 2540; i++) {
+            live.push_back(records.create());
+        }
+        auto mapped = mapped_bytes() - before;
+        auto used = live.size() * sizeof(Record);
+        std::cout << "records: " << used << " bytes, mapped: " << mapped << " bytes\n";
+        assert(mapped <= used + used / 16);
+        for (auto record: live) {
+            records.destroy(record);
+        }
+    }
+
+    // a cached pool may die before the threads that cached for it, main included
+    {
+        std::atomic<bool> cached{};
+        std::atomic<bool> destroyed{};
+        std::thread late{};
+        {
+            SharedPool<long> scoped{};
+            scoped.destroy(scoped.create(1));
+            late = std::thread{[&] {
+                scoped.destroy(scoped.create(2));
+                cached = true;
+                while (!destroyed) {
+                    std::this_thread::yield();
+                }
+            }};
+            while (!cached) {
+                std::this_thread::yield();
+            }
+        }
+        destroyed = true;
+        late.join();
+    }
+
+    std::vector<std::thread> threads{};
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([] {
+            std::vector<Pooled<Connection>> live{};
+            for (int i = 0; i < 1000; i++) {
+                live.push_back(make_pooled<Connection>(i, 0.0));
+                if (live.size() > 16) {
+                    live.clear();
+                }
+            }
+        });
+    }
+    for (auto &thread: threads) {
+        thread.join();
+    }
+    CrossAlloc::visualize();
+}
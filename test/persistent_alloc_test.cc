@@ -0,0 +1,170 @@
+//
+// Created by PinkLure on 9/20/2022.
+//
+
+#include "../persistent_alloc.h"
+
+#include <iostream>
+
+#include <sys/wait.h>
+
+// nodes link by offset, so the list survives remapping at another base
+struct Node {
+    std::uint64_t value;
+    std::uint64_t next;
+};
+
+static std::uint64_t sum_list(PersistentAlloc &heap) {
+    std::uint64_t sum = 0;
+    for (auto node = (Node *) heap.root(); node != nullptr; node = (Node *) heap.at(node->next)) {
+        sum += node->value;
+    }
+    return sum;
+}
+
+int main() {
+    auto path = "persistent_alloc_test.heap";
+    unlink(path);
+
+    {
+        PersistentAlloc heap{path, 1 << 20};
+        Node *head{};
+        void *scratch[50]{};
+        for (std::uint64_t i = 1; i <= 100; i++) {
+            auto node = (Node *) heap.alloc(sizeof(Node));
+            node->value = i;
+            node->next = head == nullptr ? 0 : heap.offset_of(head);
+            head = node;
+            if (i % 2 == 0) {
+                scratch[i / 2 - 1] = heap.alloc(100 + i);
+            }
+        }
+        heap.set_root(head);
+        for (auto mem: scratch) {
+            assert(heap.dealloc(mem));
+        }
+        assert(heap.check());
+        std::cout << "first base: " << (void *) heap.base() << "\n";
+    }
+
+    {
+        PersistentAlloc heap{path, 0};
+        std::cout << "second base: " << (void *) heap.base() << "\n";
+        assert(sum_list(heap) == 5050);
+        assert(heap.check());
+    }
+
+    // one process owns the heap: a second open fails and a forked child leaves the heap alone
+    {
+        PersistentAlloc heap{path, 0};
+        bool refused = false;
+        try {
+            PersistentAlloc other{path, 0};
+        } catch (std::system_error const &) {
+            refused = true;
+        }
+        assert(refused);
+
+        auto pid = fork();
+        if (pid == 0) {
+            _exit(heap.alloc(sizeof(Node)) == nullptr && !heap.check() ? 0 : 1);
+        }
+        int status{};
+        waitpid(pid, &status, 0);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+        assert(heap.check() && sum_list(heap) == 5050);
+    }
+
+    // a child that outlives the parent's heap does not keep the file locked
+    {
+        int release[2]{};
+        assert(pipe(release) == 0);
+        pid_t pid{};
+        {
+            PersistentAlloc heap{path, 0};
+            pid = fork();
+            if (pid == 0) {
+                char byte{};
+                close(release[1]);
+                _exit(read(release[0], &byte, 1) == 1 ? 0 : 1);
+            }
+        }
+        close(release[0]);
+        {
+            PersistentAlloc heap{path, 0};
+            assert(heap.check() && sum_list(heap) == 5050);
+        }
+        assert(write(release[1], "x", 1) == 1);
+        close(release[1]);
+        int status{};
+        waitpid(pid, &status, 0);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+
+    // a process dying without closing leaves the heap dirty, the next open checks it
+    auto pid = fork();
+    if (pid == 0) {
+        PersistentAlloc heap{path, 0};
+        auto node = (Node *) heap.alloc(sizeof(Node));
+        node->value = 1000;
+        node->next = heap.offset_of(heap.root());
+        heap.set_root(node);
+        _exit(0);
+    }
+    waitpid(pid, nullptr, 0);
+
+    {
+        PersistentAlloc heap{path, 0};
+        assert(sum_list(heap) == 6050);
+        assert(heap.recover() && heap.check());
+        assert(heap.alloc(2 << 20) == nullptr);
+    }
+
+    // a free list entry pointing into a live block is caught by check and dropped by recover
+    {
+        PersistentAlloc heap{path, 0};
+        void *blocks[5]{};
+        for (auto &block: blocks) {
+            block = heap.alloc(200);
+        }
+        assert(heap.dealloc(blocks[1]) && heap.dealloc(blocks[3]));
+        assert(heap.check());
+
+        // a free block keeps its header {size_and_free, prev_size} before and its links {prev, next} at the pointer
+        constexpr std::uint64_t header = 2 * sizeof(std::uint64_t);
+        auto links3 = (std::uint64_t *) blocks[3];
+        auto links1 = (std::uint64_t *) blocks[1];
+        assert(links3[1] == heap.offset_of(blocks[1]) - header);
+
+        // swap blocks[1] on its list for a forged free block inside live blocks[0]
+        auto fake = (std::uint64_t *) blocks[0];
+        fake[0] = links1[-2];
+        fake[1] = 0;
+        fake[2] = links1[0];
+        fake[3] = links1[1];
+        if (links1[1] != 0) {
+            ((std::uint64_t *) heap.at(links1[1] + header))[0] = heap.offset_of(fake);
+        }
+        links3[1] = heap.offset_of(fake);
+        assert(!heap.check());
+        assert(heap.recover() && heap.check());
+
+        // blocks[0] is never handed out again
+        auto begin = (std::byte *) blocks[0], end = begin + 200;
+        void *again[4]{};
+        for (auto &mem: again) {
+            mem = heap.alloc(200);
+            assert(mem != nullptr && (mem >= end || (std::byte *) mem + 200 <= begin));
+        }
+        for (auto mem: again) {
+            assert(heap.dealloc(mem));
+        }
+        for (auto i: {0, 2, 4}) {
+            assert(heap.dealloc(blocks[i]));
+        }
+        assert(heap.check() && sum_list(heap) == 6050);
+    }
+
+    unlink(path);
+    std::cout << "persistent heap: ok\n";
+}
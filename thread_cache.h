@@ -0,0 +1,175 @@
+//
+// Created by PinkLure on 9/19/2022.
+//
+
+#ifndef ALLOCATOR_THREAD_CACHE_H
+#define ALLOCATOR_THREAD_CACHE_H
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+
+// intrusive link stored in the first word of a cached block
+struct CacheLink {
+    CacheLink *next;
+};
+
+// per-thread caches in front of a shared owner (BasicHeap, ObjectPool)
+// every thread keeps BINS lists of freed blocks for the first owner it registers with,
+// a destroyed owner takes its blocks back with release_all, so the thread may outlive it,
+// but no thread may use or exit from the owner while it is being destroyed
+// Owner embeds the registry as $caches and provides, to a friend ThreadCacheRegistry:
+//   Lock lock;                                 guards the registry
+//   void release_cached(CacheLink *list);      take back a chain of blocks, caller holds lock
+template<typename Owner, std::size_t BINS>
+class ThreadCacheRegistry {
+public:
+    class Cache {
+        friend ThreadCacheRegistry;
+
+        // cleared by release_all on the destroying thread, read by the owning thread at exit
+        std::atomic<Owner *> owner{};
+        CacheLink *heads[BINS]{};
+        std::size_t counts[BINS]{};
+
+        std::thread::id thread{};
+        Cache *prev{};
+        Cache *next{};
+
+    public:
+        Cache() = default;
+
+        Cache(Cache const &) = delete;
+
+        void operator=(Cache const &) = delete;
+
+        // the thread exits, its blocks go back to the owner
+        ~Cache() {
+            auto bound_owner = owner.load(std::memory_order_acquire);
+            if (bound_owner == nullptr) {
+                return;
+            }
+            std::lock_guard guard{bound_owner->lock};
+            bound_owner->caches.unlink(*this, [&](CacheLink *list) { bound_owner->release_cached(list); });
+        }
+
+        Owner *bound() const {
+            return owner.load(std::memory_order_relaxed);
+        }
+
+        std::size_t count(std::size_t bin) const {
+            return counts[bin];
+        }
+
+        // nullptr if the bin is empty
+        void *pop(std::size_t bin) {
+            auto link = heads[bin];
+            if (link == nullptr) {
+                return nullptr;
+            }
+            heads[bin] = link->next;
+            counts[bin]--;
+            return link;
+        }
+
+        void push(std::size_t bin, void *mem) {
+            auto link = (CacheLink *) mem;
+            link->next = heads[bin];
+            heads[bin] = link;
+            counts[bin]++;
+        }
+    };
+
+    // the calling thread's cache, bound to no owner until claimed
+    static Cache &local() {
+        thread_local Cache cache{};
+        return cache;
+    }
+
+    // bind $cache to $owner, caller holds owner.lock
+    void claim(Owner &owner, Cache &cache) {
+        cache.owner.store(&owner, std::memory_order_relaxed);
+        cache.thread = std::this_thread::get_id();
+        cache.next = head;
+        if (head != nullptr) {
+            head->prev = &cache;
+        }
+        head = &cache;
+    }
+
+    // in a forked child only the calling thread survives
+    // the blocks of every other thread are relinked onto the orphan list, nothing is allocated or released,
+    // the owner hands them back with release_orphans once the fork handler returned
+    // caller holds owner.lock
+    void reclaim_dead() {
+        auto self = std::this_thread::get_id();
+        auto curr = head;
+        while (curr != nullptr) {
+            auto next = curr->next;
+            if (curr->thread != self) {
+                unlink(*curr, [&](CacheLink *list) {
+                    auto tail = list;
+                    while (tail->next != nullptr) {
+                        tail = tail->next;
+                    }
+                    tail->next = orphans.load(std::memory_order_relaxed);
+                    orphans.store(list, std::memory_order_relaxed);
+                });
+            }
+            curr = next;
+        }
+    }
+
+    // the owner is being destroyed: every cache gives its blocks back and is detached,
+    // so a thread exiting later finds its cache unbound
+    // caller holds owner.lock
+    void release_all(Owner &owner) {
+        while (head != nullptr) {
+            unlink(*head, [&](CacheLink *list) { owner.release_cached(list); });
+        }
+        release_orphans(owner);
+    }
+
+    // cheap check for the slow paths, no lock needed
+    bool has_orphans() const {
+        return orphans.load(std::memory_order_relaxed) != nullptr;
+    }
+
+    // give the blocks left by reclaim_dead to $owner, caller holds owner.lock
+    void release_orphans(Owner &owner) {
+        if (auto list = orphans.exchange(nullptr, std::memory_order_acquire); list != nullptr) {
+            owner.release_cached(list);
+        }
+    }
+
+private:
+    Cache *head{};
+    // written only by the fork child handler, read without the owner lock on slow paths
+    std::atomic<CacheLink *> orphans{};
+
+    // hand every non-empty bin of $cache to $release and detach it, caller holds owner.lock
+    template<typename F>
+    void unlink(Cache &cache, F &&release) {
+        for (std::size_t i = 0; i < BINS; i++) {
+            if (cache.heads[i] != nullptr) {
+                release(cache.heads[i]);
+            }
+            cache.heads[i] = nullptr;
+            cache.counts[i] = 0;
+        }
+        if (cache.prev != nullptr) {
+            cache.prev->next = cache.next;
+        } else {
+            head = cache.next;
+        }
+        if (cache.next != nullptr) {
+            cache.next->prev = cache.prev;
+        }
+        cache.prev = nullptr;
+        cache.next = nullptr;
+        cache.owner.store(nullptr, std::memory_order_release);
+    }
+};
+
+#endif //ALLOCATOR_THREAD_CACHE_H